@@ -0,0 +1,92 @@
+/* Micro-benchmark of the weighted Levenshtein kernels on header-like names.
+ *
+ * Usage: levenshtein_bench [num_names] [max_distance]
+ */
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../levenshtein_distance.hpp"
+
+static std::vector<std::string> make_names(size_t count, std::mt19937 &rng) {
+  const std::vector<std::string> words = {
+      "config", "util",  "Image", "buffer", "Stream", "thread", "mat",
+      "Engine", "io",    "json",  "Vec",    "node",   "graph",  "JRS",
+      "debug",  "alloc", "Data",  "source", "perf",   "assert"};
+  const std::vector<std::string> exts = {".h", ".hpp"};
+  std::vector<std::string> names;
+  for (size_t i = 0; i < count; ++i) {
+    std::string name;
+    int num_words = 1 + rng() % 3;
+    for (int w = 0; w < num_words; ++w) {
+      if (w > 0 && rng() % 2) {
+        name += "_";
+      }
+      name += words[rng() % words.size()];
+    }
+    name += exts[rng() % exts.size()];
+    names.push_back(name);
+  }
+  return names;
+}
+
+template <typename F>
+static void run(const char *label, const std::vector<std::string> &queries,
+                const std::vector<std::string> &names, F &&distance) {
+  auto start = std::chrono::steady_clock::now();
+  long checksum = 0;
+  for (const std::string &q : queries) {
+    for (const std::string &n : names) {
+      checksum += distance(q, n);
+    }
+  }
+  auto end = std::chrono::steady_clock::now();
+  double secs = std::chrono::duration<double>(end - start).count();
+  double pairs = double(queries.size()) * names.size();
+  std::cout << label << ": " << secs * 1e9 / pairs << " ns/pair  ("
+            << pairs / secs / 1e6 << " Mpairs/s, checksum " << checksum << ")"
+            << std::endl;
+}
+
+int main(int argc, char **argv) {
+  size_t num_names = argc > 1 ? std::stoul(argv[1]) : 20000;
+  int max_distance = argc > 2 ? std::stoi(argv[2]) : 8;
+
+  std::mt19937 rng(42);
+  std::vector<std::string> names = make_names(num_names, rng);
+  std::vector<std::string> queries = make_names(100, rng);
+
+  std::vector<std::string> lower_names;
+  for (const std::string &n : names) {
+    lower_names.push_back(ascii_lower(n));
+  }
+
+  std::cout << names.size() << " names x " << queries.size()
+            << " queries, max_distance=" << max_distance << std::endl;
+
+  run("levenshtein_distance (reference)", queries, names,
+      [&](const std::string &q, const std::string &n) {
+        return std::min(levenshtein_distance(n, q), max_distance + 1);
+      });
+  run("bounded, no cutoff             ", queries, names,
+      [&](const std::string &q, const std::string &n) {
+        return std::min(bounded_levenshtein_distance(n, q, INT32_MAX),
+                        max_distance + 1);
+      });
+  size_t idx = 0;
+  std::string q_lower;
+  const std::string *q_prev = nullptr;
+  run("bounded, cutoff, lowercase keys", queries, names,
+      [&](const std::string &q, const std::string &n) {
+        if (&q != q_prev) {
+          q_lower = ascii_lower(q);
+          q_prev = &q;
+          idx = 0;
+        }
+        LevenshteinKey key{n, lower_names[idx++]};
+        return bounded_levenshtein_distance(key, {q, q_lower}, max_distance);
+      });
+  return 0;
+}
@@ -0,0 +1,104 @@
+/* Benchmark of header indexing and include resolution alone, on a synthetic
+ * tree that only exists in memory (MemoryVfs): no disk access and no file
+ * scanning are timed, only the resolver itself.
+ *
+ * Usage: resolve_bench [num_headers] [num_includes] [fuzzy]
+ */
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../resolver.hpp"
+
+static std::string make_name(std::mt19937 &rng) {
+  const std::vector<std::string> words = {
+      "config", "util",  "Image", "buffer", "Stream", "thread", "mat",
+      "Engine", "io",    "json",  "Vec",    "node",   "graph",  "Jrs",
+      "debug",  "alloc", "Data",  "source", "perf",   "assert"};
+  std::string name;
+  int num_words = 1 + rng() % 3;
+  for (int w = 0; w < num_words; ++w) {
+    if (w > 0 && rng() % 2) {
+      name += "_";
+    }
+    name += words[rng() % words.size()];
+  }
+  return name + std::to_string(rng() % 1000) + (rng() % 2 ? ".hpp" : ".h");
+}
+
+static std::string make_dir(std::mt19937 &rng) {
+  std::string dir;
+  int levels = 1 + rng() % 3;
+  for (int l = 0; l < levels; ++l) {
+    dir += "mod" + std::to_string(rng() % 8) + "/";
+  }
+  return dir;
+}
+
+/* The headers under dir, as find_headers() lists them on disk. */
+static void list_headers(const Vfs &vfs, const fs::path &dir,
+                         std::vector<std::string> &headers) {
+  for (const VfsEntry &e : vfs.list(dir)) {
+    fs::path path = dir / e.name;
+    if (e.type == VfsType::Directory) {
+      list_headers(vfs, path, headers);
+    } else if (has_header_extension(path)) {
+      headers.push_back(path.string());
+    }
+  }
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+int main(int argc, char **argv) {
+  size_t num_headers = argc > 1 ? std::stoul(argv[1]) : 20000;
+  size_t num_includes = argc > 2 ? std::stoul(argv[2]) : 100000;
+  Options options;
+  options.fuzzy = argc > 3 ? std::stoi(argv[3]) : 0;
+
+  std::mt19937 rng(42);
+  MemoryVfs vfs("/project");
+  std::vector<std::string> headers; // relative to include
+  for (size_t i = 0; i < num_headers; ++i) {
+    headers.push_back(make_dir(rng) + make_name(rng));
+    vfs.add_file("include/" + headers.back());
+  }
+  /* A fifth of the includes is broken: the header moved to another
+   * directory. */
+  std::vector<std::pair<IncludeStmt, fs::path>> includes;
+  for (size_t i = 0; i < num_includes; ++i) {
+    fs::path file = "src/" + make_dir(rng) + "file" +
+                    std::to_string(rng() % 1000) + ".cpp";
+    vfs.add_file(file);
+    const std::string &header = headers[rng() % headers.size()];
+    std::string path =
+        rng() % 5 ? header : "old/" + fs::path(header).filename().string();
+    includes.push_back({IncludeStmt{path}, "/project" / file});
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  IncludePath include{"/project/include", false};
+  HeaderMap map;
+  list_headers(vfs, include.path, map[include]);
+  Resolver resolver(options, {include}, std::move(map), vfs);
+  std::cout << "index: " << seconds_since(start) << " s ("
+            << resolver.index().num_entries() << " headers)" << std::endl;
+
+  for (const char *pass : {"resolve (cold)", "resolve (cached)"}) {
+    start = std::chrono::steady_clock::now();
+    size_t candidates = 0;
+    for (const auto &[include, file] : includes) {
+      candidates += resolver.resolve(include, SourceFile{file, vfs})->size();
+    }
+    double secs = seconds_since(start);
+    std::cout << pass << ": " << secs << " s, " << includes.size() / secs
+              << " includes/s (" << candidates << " candidates)" << std::endl;
+  }
+  return 0;
+}
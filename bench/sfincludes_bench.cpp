@@ -0,0 +1,275 @@
+/* End-to-end benchmark on synthetic project trees.
+ *
+ * Generates a tree of headers and sources with a configurable share of broken
+ * (moved) and renamed includes, and times the sfincludes executable on it:
+ * header indexing, exact resolution, fuzzy resolution, and the actual
+ * rewrite. Because it drives the executable, it can also time an older build
+ * (--sfincludes) on the very same tree, to compare versions.
+ */
+#include <boost/program_options.hpp>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace po = boost::program_options;
+namespace fs = std::filesystem;
+
+struct TreeConfig {
+  size_t headers{1000};
+  size_t files{500};
+  size_t includes_per_file{20};
+  int depth{3};
+  double duplicates{0.05};
+  double broken{0.2};
+  double renamed{0.05};
+  unsigned seed{42};
+};
+
+struct Preset {
+  const char *name;
+  size_t headers;
+  size_t files;
+};
+
+// All presets use 20 includes per file.
+const Preset PRESETS[] = {
+    {"10k", 1000, 500},
+    {"100k", 10000, 5000},
+    {"1M", 50000, 50000},
+};
+
+struct GeneratedTree {
+  size_t files{0};
+  size_t includes{0};
+};
+
+static std::string make_name(std::mt19937 &rng) {
+  static const std::vector<std::string> words = {
+      "config", "util",  "Image",  "buffer", "Stream", "thread", "mat",
+      "Engine", "io",    "json",   "Vec",    "node",   "graph",  "Jrs",
+      "debug",  "alloc", "Data",   "source", "perf",   "assert", "Memory",
+      "parser", "Lexer", "socket", "Task",   "queue",  "hash",   "Color"};
+  std::string name;
+  int num_words = 2 + rng() % 3;
+  for (int w = 0; w < num_words; ++w) {
+    if (w > 0 && rng() % 2) {
+      name += "_";
+    }
+    name += words[rng() % words.size()];
+  }
+  return name + std::to_string(rng() % 1000);
+}
+
+static std::string make_dir(std::mt19937 &rng, int depth) {
+  std::string dir;
+  int levels = 1 + rng() % depth;
+  for (int l = 0; l < levels; ++l) {
+    dir += "mod" + std::to_string(rng() % 8) + "/";
+  }
+  return dir;
+}
+
+/* A renamed header: one character is capitalized, changed or dropped, which
+ * only --fuzzy can match. */
+static std::string misspell(std::string name, std::mt19937 &rng) {
+  size_t pos = rng() % name.size();
+  switch (rng() % 3) {
+  case 0:
+    name[pos] = std::toupper(name[pos]) == name[pos] ? std::tolower(name[pos])
+                                                     : std::toupper(name[pos]);
+    break;
+  case 1:
+    name[pos] = 'x';
+    break;
+  default:
+    name.erase(pos, 1);
+    break;
+  }
+  return name;
+}
+
+static GeneratedTree generate(const fs::path &root, const TreeConfig &config) {
+  std::mt19937 rng(config.seed);
+  std::uniform_real_distribution<double> chance(0.0, 1.0);
+
+  fs::remove_all(root);
+  std::vector<std::string> headers; // relative to root/include
+  std::vector<std::string> names;
+  for (size_t i = 0; i < config.headers; ++i) {
+    std::string name;
+    if (!names.empty() && chance(rng) < config.duplicates) {
+      name = names[rng() % names.size()];
+    } else {
+      name = make_name(rng) + (rng() % 2 ? ".hpp" : ".h");
+      names.push_back(name);
+    }
+    std::string header = make_dir(rng, config.depth) + name;
+    fs::path path = root / "include" / header;
+    fs::create_directories(path.parent_path());
+    std::ofstream(path) << "#pragma once\n\nint f" << i << "();\n";
+    headers.push_back(header);
+  }
+
+  GeneratedTree tree;
+  for (size_t i = 0; i < config.files; ++i) {
+    fs::path path = root / "src" / make_dir(rng, config.depth) /
+                    ("file" + std::to_string(i) + ".cpp");
+    fs::create_directories(path.parent_path());
+    std::ofstream out(path);
+    out << "// Generated source file " << i << "\n";
+    for (size_t j = 0; j < config.includes_per_file; ++j) {
+      const std::string &header = headers[rng() % headers.size()];
+      fs::path hdr(header);
+      double r = chance(rng);
+      if (r < config.renamed) {
+        std::string name = misspell(hdr.filename().string(), rng);
+        out << "#include \"" << name << "\"\n";
+      } else if (r < config.renamed + config.broken) {
+        out << "#include \"old/" << hdr.filename().string() << "\"\n";
+      } else {
+        out << "#include \"" << header << "\" // up to date\n";
+      }
+      tree.includes++;
+    }
+    out << "#include <vector>\n\nint main" << i << "() { return 0; }\n";
+    tree.files++;
+  }
+  return tree;
+}
+
+static double run(const std::string &command) {
+  auto start = std::chrono::steady_clock::now();
+  int status = std::system((command + " > /dev/null").c_str());
+  auto end = std::chrono::steady_clock::now();
+  if (status != 0) {
+    std::cerr << "Command failed (" << status << "): " << command << std::endl;
+    std::exit(1);
+  }
+  return std::chrono::duration<double>(end - start).count();
+}
+
+static void report(const std::string &phase, double secs,
+                   const GeneratedTree &tree, bool per_include) {
+  std::ios_base::fmtflags flags = std::cout.flags();
+  std::streamsize precision = std::cout.precision();
+  std::cout << "  " << std::left << std::setw(18) << phase << std::right
+            << std::fixed << std::setprecision(3) << std::setw(9) << secs
+            << " s";
+  if (per_include) {
+    std::cout << std::setprecision(0) << std::setw(12) << tree.files / secs
+              << " files/s" << std::setw(14) << tree.includes / secs
+              << " includes/s";
+  }
+  std::cout << std::endl;
+  std::cout.flags(flags);
+  std::cout.precision(precision);
+}
+
+int main(int argc, char **argv) {
+  TreeConfig config;
+  std::string sfincludes = SFINCLUDES_EXE;
+  std::string work_dir =
+      (fs::temp_directory_path() / "sfincludes_bench").string();
+  std::vector<std::string> presets;
+  int fuzzy = 8;
+  int jobs = 1;
+
+  po::options_description desc("Allowed options");
+  // clang-format off
+  desc.add_options()
+      ("help", "Produce help message.")
+      ("sfincludes", po::value<std::string>(&sfincludes),
+       "The sfincludes executable to benchmark.")
+      ("work-dir", po::value<std::string>(&work_dir),
+       "Directory to generate the trees in (will be erased).")
+      ("preset", po::value<std::vector<std::string>>(&presets),
+       "Standard tree size: 10k, 100k or 1M includes. [repeat to run more] "
+       "Without a preset, the tree is generated from the options below.")
+      ("headers", po::value<size_t>(&config.headers), "Number of headers.")
+      ("files", po::value<size_t>(&config.files), "Number of source files.")
+      ("includes-per-file", po::value<size_t>(&config.includes_per_file),
+       "Includes per source file.")
+      ("depth", po::value<int>(&config.depth), "Maximal directory depth.")
+      ("duplicates", po::value<double>(&config.duplicates),
+       "Share of headers reusing the filename of another header.")
+      ("broken", po::value<double>(&config.broken),
+       "Share of includes with a wrong directory.")
+      ("renamed", po::value<double>(&config.renamed),
+       "Share of includes with a misspelled filename.")
+      ("seed", po::value<unsigned>(&config.seed), "Random seed.")
+      ("fuzzy", po::value<int>(&fuzzy), "--fuzzy for the fuzzy resolution run.")
+      ("jobs", po::value<int>(&jobs), "--jobs passed to sfincludes.")
+      ;
+  // clang-format on
+
+  po::variables_map vm;
+  po::store(po::parse_command_line(argc, argv, desc), vm);
+  po::notify(vm);
+  if (vm.count("help")) {
+    std::cout << desc << std::endl;
+    return 1;
+  }
+
+  std::vector<std::pair<std::string, TreeConfig>> configs;
+  if (presets.empty()) {
+    configs.push_back({"custom", config});
+  }
+  for (const std::string &name : presets) {
+    bool found = false;
+    for (const Preset &preset : PRESETS) {
+      if (name == preset.name) {
+        TreeConfig c = config;
+        c.headers = preset.headers;
+        c.files = preset.files;
+        c.includes_per_file = 20;
+        configs.push_back({name, c});
+        found = true;
+      }
+    }
+    if (!found) {
+      std::cerr << "Unknown preset: " << name << std::endl;
+      return 1;
+    }
+  }
+
+  fs::path root = fs::path(work_dir);
+  fs::path empty_src = root / "empty";
+  std::string base = sfincludes + " --jobs " + std::to_string(jobs) +
+                     " --user-include-path " + (root / "include").string() +
+                     " --omit-untouched";
+
+  for (const auto &[name, c] : configs) {
+    std::cout << "[" << name << "] headers=" << c.headers
+              << " files=" << c.files
+              << " includes/file=" << c.includes_per_file
+              << " depth=" << c.depth << " duplicates=" << c.duplicates
+              << " broken=" << c.broken << " renamed=" << c.renamed
+              << std::endl;
+
+    auto start = std::chrono::steady_clock::now();
+    GeneratedTree tree = generate(root, c);
+    fs::create_directories(empty_src);
+    double gen = std::chrono::duration<double>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+    report("generate", gen, tree, false);
+
+    std::string src = " --src " + (root / "src").string();
+    double index = run(base + " --src " + empty_src.string());
+    report("index headers", index, tree, false);
+    report("exact resolve", run(base + src) - index, tree, true);
+    std::string fuzzy_arg = " --fuzzy " + std::to_string(fuzzy);
+    report("fuzzy resolve", run(base + src + fuzzy_arg) - index, tree, true);
+    std::string journal = " --undo-journal " + (root / "undo").string();
+    report("rewrite (total)", run(base + src + " --no-dry-run" + journal),
+           tree, true);
+  }
+  fs::remove_all(root);
+  return 0;
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+
+/* Burkhard-Keller tree over items identified by a uint32_t id. The distance
+ * function must be a metric (symmetric, and obeying the triangle inequality),
+ * which the weighted levenshtein_distance is, because insertions and deletions
+ * cost the same and changing a character never costs more than capitalizing
+ * it and then changing it. */
+class BKTree {
+public:
+  template <typename Distance> void insert(uint32_t id, Distance &&distance) {
+    if (nodes_.empty()) {
+      nodes_.push_back({id, 0, {}});
+      return;
+    }
+    uint32_t node = 0;
+    while (true) {
+      int d = distance(nodes_[node].id, id);
+      uint32_t next = UINT32_MAX;
+      for (const Edge &e : nodes_[node].children) {
+        if (e.distance == d) {
+          next = e.child;
+          break;
+        }
+      }
+      if (next == UINT32_MAX) {
+        uint32_t child = nodes_.size();
+        nodes_[node].children.push_back({d, child});
+        nodes_[node].max_edge = std::max(nodes_[node].max_edge, d);
+        nodes_.push_back({id, 0, {}});
+        return;
+      }
+      node = next;
+    }
+  }
+
+  /* Calls found(id, distance) for every item within max_distance of the
+   * query. distance_to_query(id, cutoff) computes the distance from an item
+   * to the query, and may return any value above cutoff once it is known to
+   * exceed it: beyond that, neither the item nor any of its children can
+   * match. Subtrees which cannot contain a match are never visited. */
+  template <typename Distance, typename Found>
+  void search(int max_distance, Distance &&distance_to_query,
+              Found &&found) const {
+    if (nodes_.empty()) {
+      return;
+    }
+    std::vector<uint32_t> stack{0};
+    while (!stack.empty()) {
+      const Node &node = nodes_[stack.back()];
+      stack.pop_back();
+      int d = distance_to_query(node.id, node.max_edge + max_distance);
+      if (d <= max_distance) {
+        found(node.id, d);
+      }
+      for (const Edge &e : node.children) {
+        if (std::abs(e.distance - d) <= max_distance) {
+          stack.push_back(e.child);
+        }
+      }
+    }
+  }
+
+  size_t size() const { return nodes_.size(); }
+
+  size_t memory_usage() const {
+    size_t bytes = nodes_.capacity() * sizeof(Node);
+    for (const Node &node : nodes_) {
+      bytes += node.children.capacity() * sizeof(Edge);
+    }
+    return bytes;
+  }
+
+private:
+  struct Edge {
+    int distance;
+    uint32_t child;
+  };
+  struct Node {
+    uint32_t id;
+    int max_edge;
+    std::vector<Edge> children;
+  };
+  std::vector<Node> nodes_;
+};
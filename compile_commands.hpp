@@ -0,0 +1,116 @@
+#pragma once
+
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "resolver.hpp"
+#include "sfincludes.hpp"
+
+/* Splits a command line like a POSIX shell would, without expansions. */
+inline std::vector<std::string> split_command_line(const std::string &command) {
+  std::vector<std::string> args;
+  std::string arg;
+  bool in_arg = false;
+  char quote = 0;
+  for (size_t i = 0; i < command.size(); ++i) {
+    char c = command[i];
+    if (quote) {
+      if (c == quote) {
+        quote = 0;
+      } else if (c == '\\' && quote == '"' && i + 1 < command.size()) {
+        arg += command[++i];
+      } else {
+        arg += c;
+      }
+    } else if (c == '\'' || c == '"') {
+      quote = c;
+      in_arg = true;
+    } else if (c == '\\' && i + 1 < command.size()) {
+      arg += command[++i];
+      in_arg = true;
+    } else if (c == ' ' || c == '\t' || c == '\n') {
+      if (in_arg) {
+        args.push_back(std::move(arg));
+        arg.clear();
+        in_arg = false;
+      }
+    } else {
+      arg += c;
+      in_arg = true;
+    }
+  }
+  if (in_arg) {
+    args.push_back(std::move(arg));
+  }
+  return args;
+}
+
+/* The include search paths in compiler arguments: -I and -iquote as user
+ * include paths, -isystem and -idirafter as system include paths.
+ * Relative paths are relative to directory. */
+inline std::vector<IncludePath>
+include_paths_of(const std::vector<std::string> &args,
+                 const fs::path &directory) {
+  struct Flag {
+    std::string_view name;
+    bool system;
+  };
+  const Flag flags[] = {{"-isystem", true},
+                        {"-idirafter", true},
+                        {"-iquote", false},
+                        {"-I", false}};
+  std::vector<IncludePath> paths;
+  for (size_t i = 0; i < args.size(); ++i) {
+    for (const Flag &flag : flags) {
+      if (args[i].compare(0, flag.name.size(), flag.name) != 0) {
+        continue;
+      }
+      std::string value = args[i].substr(flag.name.size());
+      if (value.empty() && i + 1 < args.size()) {
+        value = args[++i];
+      }
+      if (!value.empty()) {
+        paths.push_back({(directory / value).lexically_normal(), flag.system});
+      }
+      break;
+    }
+  }
+  return paths;
+}
+
+/* Reads a compilation database (compile_commands.json): every entry becomes
+ * a task for its file, with the include paths of its command, followed by
+ * extra_include_paths. Throws on a malformed file. */
+inline std::vector<SourceTask>
+load_compile_commands(const fs::path &path,
+                      const std::vector<IncludePath> &extra_include_paths) {
+  namespace pt = boost::property_tree;
+  pt::ptree db;
+  pt::read_json(path.string(), db);
+
+  std::vector<SourceTask> tasks;
+  for (const auto &[unused, entry] : db) {
+    fs::path directory = entry.get<std::string>("directory", "");
+    std::vector<std::string> args;
+    if (auto arguments = entry.get_child_optional("arguments")) {
+      for (const auto &[unused, arg] : *arguments) {
+        args.push_back(arg.get_value<std::string>());
+      }
+    } else {
+      args = split_command_line(entry.get<std::string>("command", ""));
+    }
+    std::vector<IncludePath> include_paths = include_paths_of(args, directory);
+    include_paths.insert(include_paths.end(), extra_include_paths.begin(),
+                         extra_include_paths.end());
+    fs::path file = directory / entry.get<std::string>("file");
+    file = file.lexically_normal();
+    tasks.push_back(
+        {file, std::make_shared<const std::vector<IncludePath>>(
+                   std::move(include_paths))});
+  }
+  return tasks;
+}
@@ -0,0 +1,491 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <stdlib.h>
+#include <unistd.h>
+#define SFINCLUDES_HAVE_POPEN 1
+#endif
+
+#include "header_index.hpp"
+#include "include_scanner.hpp"
+#include "mapped_file.hpp"
+#include "sfincludes.hpp"
+#include "stats.hpp"
+#include "traversal.hpp"
+
+/* What identifies the contents of a header, also once it was moved, renamed
+ * and edited a little. The MinHash signature is taken over the words outside
+ * comments, three in a row ("shingles"), so that a license header or a
+ * changed comment does not matter, and neither does the include guard, which
+ * is often renamed with the header. The share of hashes two headers agree in
+ * estimates the share of their shingles they have in common. A SimHash would
+ * be smaller, but is too unstable for the few hundred shingles of a header. */
+struct Fingerprint {
+  static constexpr int NUM_HASHES = 16;
+
+  uint64_t content{0}; // FNV-1a of all bytes
+  std::array<uint32_t, NUM_HASHES> minhash{};
+  uint32_t shingles{0};
+  std::string guard{}; // the include guard macro, if there is one
+};
+
+namespace fingerprint_detail {
+
+/* splitmix64's finalizer: all bits of x affect all bits of the result. */
+inline uint64_t mix(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ull;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebull;
+  return x ^ (x >> 31);
+}
+
+/* Calls on_word for every identifier or number outside comments. */
+template <typename OnWord>
+void for_each_word(std::string_view text, OnWord &&on_word) {
+  using namespace lexer;
+  const char *p = text.data();
+  const char *end = p + text.size();
+  while (p < end) {
+    if (*p == '/' && p + 1 < end && p[1] == '/') {
+      p = skip_line_comment(p + 2, end);
+    } else if (*p == '/' && p + 1 < end && p[1] == '*') {
+      p = skip_block_comment(p + 2, end);
+    } else if (is_identifier_char(*p)) {
+      const char *word = p;
+      while (p < end && is_identifier_char(*p)) {
+        ++p;
+      }
+      on_word(std::string_view(word, p - word));
+    } else {
+      ++p;
+    }
+  }
+}
+
+/* The directive name and first argument of a '#' line. */
+inline std::pair<std::string_view, std::string_view>
+split_directive(std::string_view line) {
+  auto word_at = [&](size_t pos) {
+    while (pos < line.size() && lexer::is_blank(line[pos])) {
+      pos++;
+    }
+    size_t end = pos;
+    while (end < line.size() && lexer::is_identifier_char(line[end])) {
+      end++;
+    }
+    return std::make_pair(line.substr(pos, end - pos), end);
+  };
+  auto [name, end] = word_at(1);
+  return {name, word_at(end).first};
+}
+
+/* X, if text starts with #ifndef X and #define X. */
+inline std::string include_guard(std::string_view text) {
+  std::pair<std::string_view, std::string_view> first[2];
+  int n = 0;
+  for_each_directive_line(text, [&](size_t, std::string_view line) {
+    if (n < 2) {
+      first[n] = split_directive(line);
+    }
+    n++;
+  });
+  if (n >= 2 && first[0].first == "ifndef" && first[1].first == "define" &&
+      !first[0].second.empty() && first[0].second == first[1].second) {
+    return std::string(first[0].second);
+  }
+  return {};
+}
+
+} // namespace fingerprint_detail
+
+inline Fingerprint fingerprint(std::string_view text) {
+  using namespace fingerprint_detail;
+  Fingerprint fp;
+  fp.content = fnv1a_hash(text);
+  fp.guard = include_guard(text);
+  fp.minhash.fill(UINT32_MAX);
+  uint64_t previous[2] = {};
+  size_t num_words = 0;
+  for_each_word(text, [&](std::string_view word) {
+    if (word == fp.guard) {
+      return;
+    }
+    uint64_t hash = fnv1a_hash(word);
+    if (++num_words >= 3) {
+      uint64_t shingle = mix(mix(mix(previous[0]) ^ previous[1]) ^ hash);
+      for (int i = 0; i < Fingerprint::NUM_HASHES; ++i) {
+        uint32_t h = uint32_t(mix(shingle + i) >> 32);
+        fp.minhash[i] = std::min(fp.minhash[i], h);
+      }
+      fp.shingles++;
+    }
+    previous[0] = previous[1];
+    previous[1] = hash;
+  });
+  return fp;
+}
+
+namespace fingerprint_detail {
+
+/* fingerprint_of(i) for every i < n, jobs at a time. */
+template <typename F>
+std::vector<Fingerprint> fingerprint_all(size_t n, int jobs,
+                                         F fingerprint_of) {
+  std::vector<Fingerprint> fingerprints(n);
+  std::atomic<size_t> next{0};
+  auto work = [&]() {
+    size_t i;
+    while ((i = next++) < n) {
+      fingerprints[i] = fingerprint_of(i);
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t t = 1; t < std::min<size_t>(jobs, n); ++t) {
+    threads.emplace_back(work);
+  }
+  work();
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  return fingerprints;
+}
+
+} // namespace fingerprint_detail
+
+/* The fingerprints of files, read jobs at a time. An unreadable file gets an
+ * empty fingerprint, which matches nothing. */
+inline std::vector<Fingerprint>
+fingerprint_files(const std::vector<std::string> &files, int jobs) {
+  return fingerprint_detail::fingerprint_all(
+      files.size(), jobs, [&](size_t i) {
+        MappedFile in(files[i]);
+        return in.good() ? fingerprint(in.view()) : Fingerprint{};
+      });
+}
+
+/* Finds the headers an include of a missing header may now refer to, by
+ * the contents of the missing header's old version: headers that were moved
+ * and renamed beyond what --fuzzy matches. The old versions are taken by
+ * their path, relative to the old tree they came from; an include refers to
+ * those whose path ends in it. All lookups are hash lookups: the same
+ * contents, the same include guard, or the same pair of MinHashes in one of
+ * eight bands, which headers sharing half of their shingles most likely
+ * have. Lookups are read-only and can be done from multiple threads. */
+class ContentMatcher {
+public:
+  /* MinHashes in which the same header, edited, may differ. */
+  static constexpr int MAX_DISTANCE = Fingerprint::NUM_HASHES / 2;
+  /* The same, with the same include guard. */
+  static constexpr int MAX_GUARD_DISTANCE = Fingerprint::NUM_HASHES * 3 / 4;
+  static constexpr int NUM_BANDS = Fingerprint::NUM_HASHES / 2;
+  /* Shorter headers, such as the many empty or forwarding ones, are only
+   * matched by their include guard. */
+  static constexpr uint32_t MIN_SHINGLES = 16;
+
+  /* An old version of a header, at path: '/' separated, relative to the old
+   * tree. */
+  void add_old(const std::string &path, Fingerprint fp) {
+    size_t slash = path.rfind('/');
+    std::string name = path.substr(slash == std::string::npos ? 0 : slash + 1);
+    old_by_filename_[name].push_back(old_.size());
+    old_.push_back({path, std::move(fp)});
+  }
+
+  size_t num_old() const { return old_.size(); }
+
+  /* Fingerprints all headers of index, reading them jobs at a time. Headers
+   * added to the index after are not matched. */
+  void fingerprint_headers(const HeaderIndex &index, int jobs) {
+    entry_of_file_.assign(index.num_files(), HeaderIndex::NOT_FOUND);
+    std::vector<std::string> paths(index.num_files());
+    for (uint32_t entry = 0; entry < index.num_entries(); ++entry) {
+      uint32_t file = index.file(entry);
+      if (entry_of_file_[file] == HeaderIndex::NOT_FOUND) {
+        entry_of_file_[file] = entry;
+        paths[file] = index.path(entry).string();
+      }
+    }
+    files_ = fingerprint_files(paths, jobs);
+    for (uint32_t file = 0; file < files_.size(); ++file) {
+      const Fingerprint &fp = files_[file];
+      if (fp.shingles >= MIN_SHINGLES) {
+        by_content_[fp.content].push_back(file);
+        for (int band = 0; band < NUM_BANDS; ++band) {
+          by_band_[band][band_key(fp, band)].push_back(file);
+        }
+      }
+      if (!fp.guard.empty()) {
+        by_guard_[fp.guard].push_back(file);
+      }
+    }
+  }
+
+  /* The entries of the headers whose contents match an old version of the
+   * header include refers to, in entry order. The number of MinHashes that
+   * differ takes the place of the filename distance. */
+  std::vector<HeaderMatch> find(const IncludeStmt &include,
+                                const HeaderIndex &index) const {
+    std::string suffix;
+    for (const fs::path &name : fs::path(include.path)) {
+      if (!(suffix.empty() && (name == "." || name == ".."))) {
+        suffix += (suffix.empty() ? "" : "/") + name.string();
+      }
+    }
+    size_t slash = suffix.rfind('/');
+    auto old = old_by_filename_.find(
+        suffix.substr(slash == std::string::npos ? 0 : slash + 1));
+    if (suffix.empty() || old == old_by_filename_.end()) {
+      return {};
+    }
+    std::unordered_map<uint32_t, int> distances; // by file
+    auto match = [&](uint32_t file, int distance) {
+      auto [it, added] = distances.emplace(file, distance);
+      it->second = std::min(it->second, distance);
+    };
+    for (size_t i : old->second) {
+      const std::string &path = old_[i].path;
+      size_t start = path.size() - std::min(path.size(), suffix.size());
+      if (path.compare(start, std::string::npos, suffix) != 0 ||
+          (start > 0 && path[start - 1] != '/')) {
+        continue;
+      }
+      const Fingerprint &fp = old_[i].fingerprint;
+      bool long_enough = fp.shingles >= MIN_SHINGLES;
+      if (long_enough) {
+        if (auto it = by_content_.find(fp.content); it != by_content_.end()) {
+          for (uint32_t file : it->second) {
+            match(file, 0);
+          }
+        }
+        for (int band = 0; band < NUM_BANDS; ++band) {
+          auto it = by_band_[band].find(band_key(fp, band));
+          if (it == by_band_[band].end()) {
+            continue;
+          }
+          for (uint32_t file : it->second) {
+            int distance = minhash_distance(fp, files_[file]);
+            if (distance <= MAX_DISTANCE) {
+              match(file, distance);
+            }
+          }
+        }
+      }
+      /* A guard alone, often as generic as CONFIG_H, ranks behind the
+       * same contents. */
+      if (auto it = by_guard_.find(fp.guard);
+          !fp.guard.empty() && it != by_guard_.end()) {
+        for (uint32_t file : it->second) {
+          const Fingerprint &other = files_[file];
+          if (other.content == fp.content) {
+            match(file, 0);
+          } else if (!long_enough || other.shingles < MIN_SHINGLES) {
+            match(file, MAX_GUARD_DISTANCE);
+          } else if (int distance = minhash_distance(fp, other);
+                     distance <= MAX_GUARD_DISTANCE) {
+            match(file, std::max(distance, 1));
+          }
+        }
+      }
+    }
+
+    std::vector<HeaderMatch> matches;
+    for (auto [file, distance] : distances) {
+      std::string filename(
+          index.filename(index.filename_id(entry_of_file_[file])));
+      for (const HeaderMatch &m : index.find(filename, 0)) {
+        if (index.file(m.entry) == file) {
+          matches.push_back({m.entry, distance});
+        }
+      }
+    }
+    std::sort(matches.begin(), matches.end());
+    if (!matches.empty()) {
+      count(Stat::ContentMatches);
+    }
+    return matches;
+  }
+
+private:
+  struct OldHeader {
+    std::string path;
+    Fingerprint fingerprint;
+  };
+
+  static int minhash_distance(const Fingerprint &a, const Fingerprint &b) {
+    int distance = 0;
+    for (int i = 0; i < Fingerprint::NUM_HASHES; ++i) {
+      distance += a.minhash[i] != b.minhash[i];
+    }
+    return distance;
+  }
+
+  static uint64_t band_key(const Fingerprint &fp, int band) {
+    return uint64_t(fp.minhash[2 * band]) << 32 | fp.minhash[2 * band + 1];
+  }
+
+  std::vector<OldHeader> old_;
+  std::unordered_map<std::string, std::vector<size_t>> old_by_filename_;
+  std::vector<Fingerprint> files_; // by file of the index
+  std::vector<uint32_t> entry_of_file_;
+  std::unordered_map<uint64_t, std::vector<uint32_t>> by_content_;
+  std::unordered_map<std::string, std::vector<uint32_t>> by_guard_;
+  std::array<std::unordered_map<uint64_t, std::vector<uint32_t>>, NUM_BANDS>
+      by_band_;
+};
+
+/* Adds the headers under dir, as they are now, as old versions. */
+inline void add_old_headers(ContentMatcher &matcher, const fs::path &dir,
+                            const Options &options) {
+  std::vector<std::string> files;
+  walk_tree(dir, options, has_header_extension,
+            [&](const fs::path &file) { files.push_back(file.string()); });
+  std::vector<Fingerprint> fingerprints =
+      fingerprint_files(files, options.jobs);
+  size_t root_length = (dir / "").native().size();
+  for (size_t i = 0; i < files.size(); ++i) {
+    matcher.add_old(fs::path(files[i].substr(root_length)).generic_string(),
+                    std::move(fingerprints[i]));
+  }
+}
+
+/* Adds the headers of a revision of the git repository in the working
+ * directory as old versions, read from its object store by git, and
+ * fingerprinted jobs at a time. Throws std::runtime_error when git fails. */
+inline void add_old_headers_from_git(ContentMatcher &matcher,
+                                     const std::string &revision, int jobs) {
+#ifdef SFINCLUDES_HAVE_POPEN
+  /* Single quoted for the shell. */
+  auto quote = [](const std::string &arg) {
+    std::string quoted = "'";
+    for (char c : arg) {
+      quoted += c == '\'' ? std::string("'\\''") : std::string(1, c);
+    }
+    return quoted + "'";
+  };
+  /* Hands the output of command to read, and throws if it fails. */
+  auto run = [](const std::string &command, auto &&read) {
+    FILE *pipe = ::popen(command.c_str(), "r");
+    if (!pipe) {
+      throw std::runtime_error("cannot run " + command);
+    }
+    bool complete = read(pipe);
+    if (::pclose(pipe) != 0 || !complete) {
+      throw std::runtime_error("failed: " + command);
+    }
+  };
+  /* Up to and without the next delimiter; false at the end. */
+  auto read_until = [](FILE *in, char delimiter, std::string &out) {
+    out.clear();
+    for (int c; (c = std::fgetc(in)) != EOF;) {
+      if (c == delimiter) {
+        return true;
+      }
+      out += char(c);
+    }
+    return false;
+  };
+
+  /* "<mode> <type> <object>\t<path>" records, separated by '\0'. */
+  std::vector<std::string> paths;
+  std::string objects;
+  run("git ls-tree -r -z --full-tree " + quote(revision), [&](FILE *in) {
+    for (std::string record; read_until(in, '\0', record);) {
+      size_t tab = record.find('\t');
+      if (tab == std::string::npos) {
+        continue;
+      }
+      std::string info = record.substr(0, tab);
+      std::string path = record.substr(tab + 1);
+      if (info.find(" blob ") != std::string::npos &&
+          has_header_extension(path)) {
+        objects += info.substr(info.rfind(' ') + 1) + "\n";
+        paths.push_back(std::move(path));
+      }
+    }
+    return true;
+  });
+  if (paths.empty()) {
+    return;
+  }
+
+  /* git cat-file --batch answers the objects on its input in order, each as
+   * "<object> <type> <size>\n<contents>\n", or "<object> missing\n". */
+  std::string list =
+      (fs::temp_directory_path() / "sfincludes-XXXXXX").string();
+  int fd = ::mkstemp(list.data());
+  if (fd < 0) {
+    throw std::runtime_error("cannot create a temporary file");
+  }
+  ::close(fd);
+  std::ofstream(list, std::ios::binary) << objects;
+  /* Blobs are fingerprinted in batches of about BATCH_BYTES, while git
+   * waits. */
+  constexpr size_t BATCH_BYTES = 64 << 20;
+  std::vector<const std::string *> batch_paths;
+  std::vector<std::string> batch;
+  size_t batch_bytes = 0;
+  auto flush = [&]() {
+    std::vector<Fingerprint> fingerprints = fingerprint_detail::fingerprint_all(
+        batch.size(), jobs, [&](size_t i) { return fingerprint(batch[i]); });
+    for (size_t i = 0; i < batch.size(); ++i) {
+      matcher.add_old(*batch_paths[i], std::move(fingerprints[i]));
+    }
+    batch_paths.clear();
+    batch.clear();
+    batch_bytes = 0;
+  };
+  auto read_blobs = [&](FILE *in) {
+    std::string header;
+    for (const std::string &path : paths) {
+      if (!read_until(in, '\n', header)) {
+        return false;
+      }
+      if (header.size() >= 8 &&
+          header.compare(header.size() - 8, 8, " missing") == 0) {
+        continue;
+      }
+      std::string contents(std::stoull(header.substr(header.rfind(' ') + 1)),
+                           '\0');
+      if (std::fread(contents.data(), 1, contents.size(), in) !=
+              contents.size() ||
+          std::fgetc(in) != '\n') {
+        return false;
+      }
+      batch_bytes += contents.size();
+      batch_paths.push_back(&path);
+      batch.push_back(std::move(contents));
+      if (batch_bytes >= BATCH_BYTES) {
+        flush();
+      }
+    }
+    flush();
+    return true;
+  };
+  try {
+    run("git cat-file --batch < " + quote(list), read_blobs);
+  } catch (...) {
+    std::remove(list.c_str());
+    throw;
+  }
+  std::remove(list.c_str());
+#else
+  (void)matcher;
+  (void)revision;
+  (void)jobs;
+  throw std::runtime_error("reading git revisions needs popen()");
+#endif
+}
@@ -0,0 +1,345 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "bk_tree.hpp"
+#include "levenshtein_distance.hpp"
+#include "path_components.hpp"
+#include "sfincludes.hpp"
+#include "string_pool.hpp"
+#include "vfs.hpp"
+
+/* A header that matched an include, with the filename edit distance. */
+struct HeaderMatch {
+  uint32_t entry{};
+  int filename_distance{};
+
+  bool operator<(const HeaderMatch &other) const {
+    return entry < other.entry;
+  }
+};
+
+/* Index over all headers, keyed by their interned filename. Entries are kept
+ * in the same order as the search paths and directory walk that produced them,
+ * such that the candidate order (and thus the tie-breaking in fix_include) does
+ * not depend on how they are looked up.
+ *
+ * With millions of headers, the entries dominate memory use. They are stored
+ * as parallel arrays of ids: every path is split into a directory and a
+ * filename, both interned, so that a header costs a few integers. A header
+ * under nested search paths is one file, and an entry per search path: the
+ * file is canonicalized once, and only the path relative to the search path
+ * is stored per entry. */
+class HeaderIndex {
+public:
+  static constexpr uint32_t NOT_FOUND = UINT32_MAX;
+
+  /* The search paths are copied: the paths listed can be dropped after.
+   * Paths are canonicalized through vfs. */
+  void build(const std::map<IncludePath, std::vector<std::string>> &headers,
+             const Vfs &vfs = disk_vfs()) {
+    roots_.reserve(headers.size());
+    for (auto &e : headers) {
+      roots_.push_back(e.first);
+    }
+    size_t num_headers = 0;
+    for (auto &e : headers) {
+      num_headers += e.second.size();
+    }
+    reserve(num_headers);
+    /* Nested search paths list the same header by the same path. */
+    std::unordered_map<std::string_view, uint32_t> files;
+    uint32_t root = 0;
+    for (auto &e : headers) {
+      fs::path canonical_root = vfs.weakly_canonical(e.first.path);
+      for (const std::string &hdr : e.second) {
+        auto [it, added] = files.emplace(hdr, num_files());
+        add(root, canonical_root, hdr, added ? NOT_FOUND : it->second, vfs);
+      }
+      root++;
+    }
+  }
+
+  /* Builds the metric index used by find(). Only needed when fuzzy
+   * matching is enabled. */
+  void build_fuzzy() {
+    fuzzy_enabled_ = true;
+    for (uint32_t id = 0; id < filenames_.size(); ++id) {
+      insert_fuzzy(id);
+    }
+  }
+
+  /* Adds a header under roots()[root] after the index was built. It comes
+   * after all others in entry order. */
+  void add(uint32_t root, const fs::path &hdr,
+           const Vfs &vfs = disk_vfs()) {
+    build_by_path();
+    by_path_.emplace(hdr.string(), num_entries());
+    add(root, vfs.weakly_canonical(roots_[root].path), hdr, NOT_FOUND, vfs);
+  }
+
+  /* Removes the header at path, or all headers under it if it is a
+   * directory. Returns the indices of the removed entries. */
+  std::vector<uint32_t> remove(const fs::path &path) {
+    build_by_path();
+    std::string exact = path.string();
+    std::string prefix = (path / "").string();
+    std::vector<uint32_t> removed;
+    for (auto it = by_path_.lower_bound(exact); it != by_path_.end();) {
+      if (it->first != exact && it->first.compare(0, prefix.size(), prefix)) {
+        if (it->first > prefix) {
+          break;
+        }
+        ++it;
+        continue;
+      }
+      std::vector<uint32_t> &same_name =
+          by_filename_[filename_id(it->second)];
+      same_name.erase(std::find(same_name.begin(), same_name.end(), it->second));
+      removed.push_back(it->second);
+      it = by_path_.erase(it);
+    }
+    return removed;
+  }
+
+  /* Finds all headers whose filename is within max_distance of either the
+   * filename or the full text of the include, with distance being the
+   * smaller of both. With max_distance 0, only the exact filename matches,
+   * which is a single hash lookup. The matches are returned in entry order. */
+  std::vector<HeaderMatch> find(const std::string &include_text,
+                                int max_distance) const {
+    std::string filename = fs::path(include_text).filename().string();
+    std::vector<HeaderMatch> result;
+    if (max_distance <= 0) {
+      uint32_t filename_id = find_filename(filename);
+      if (filename_id != NOT_FOUND) {
+        for (uint32_t entry_idx : by_filename_[filename_id]) {
+          result.push_back({entry_idx, 0});
+        }
+      }
+      return result;
+    }
+
+    std::vector<std::pair<uint32_t, int>> matched;
+    auto search = [&](const std::string &query) {
+      std::string query_lower = ascii_lower(query);
+      LevenshteinKey query_key{query, query_lower};
+      fuzzy_.search(
+          max_distance,
+          [&](uint32_t id, int cutoff) {
+            return bounded_levenshtein_distance(key(id), query_key, cutoff);
+          },
+          [&](uint32_t id, int distance) { matched.push_back({id, distance}); });
+    };
+    search(filename);
+    search(include_text);
+
+    /* A filename can be found by both searches: keep the smaller distance,
+     * which sorts first. */
+    std::sort(matched.begin(), matched.end());
+    for (size_t i = 0; i < matched.size(); ++i) {
+      if (i > 0 && matched[i].first == matched[i - 1].first) {
+        continue;
+      }
+      for (uint32_t entry_idx : by_filename_[matched[i].first]) {
+        result.push_back({entry_idx, matched[i].second});
+      }
+    }
+    std::sort(result.begin(), result.end());
+    return result;
+  }
+
+  uint32_t find_filename(std::string_view filename) const {
+    return filenames_.find(filename);
+  }
+
+  /* Entries of all headers with the given filename. */
+  const std::vector<uint32_t> &with_filename(uint32_t filename_id) const {
+    return by_filename_[filename_id];
+  }
+
+  std::string_view filename(uint32_t filename_id) const {
+    return filenames_[filename_id];
+  }
+
+  size_t num_filenames() const { return filenames_.size(); }
+  const ComponentTable &components() const { return components_; }
+  const std::vector<IncludePath> &roots() const { return roots_; }
+
+  /* Entries are numbered in order, and removed ones keep their number. */
+  uint32_t num_entries() const { return root_.size(); }
+
+  /* Headers, each listed under one or more search paths. */
+  uint32_t num_files() const { return filename_id_.size(); }
+
+  /* The search path the entry was found in. */
+  const IncludePath &root(uint32_t entry) const {
+    return roots_[root_[entry]];
+  }
+  /* The header of the entry: the same for all its search paths. */
+  uint32_t file(uint32_t entry) const { return file_[entry]; }
+  uint32_t filename_id(uint32_t entry) const {
+    return filename_id_[file_[entry]];
+  }
+
+  /* The path as listed, such as the search path joined with the file. */
+  fs::path path(uint32_t entry) const {
+    return fs::path(dirs_[path_dir_[file_[entry]]]) /
+           filenames_[filename_id(entry)];
+  }
+
+  /* Same as fs::relative(path(entry), root(entry).path). */
+  std::string relative(uint32_t entry) const {
+    std::string_view dir = dirs_[relative_dir_[entry]];
+    std::string_view name = components_.name(canonical_name(entry));
+    std::string result;
+    result.reserve(dir.size() + 1 + name.size());
+    if (!dir.empty()) {
+      result.append(dir);
+      result += '/';
+    }
+    result.append(name);
+    return result;
+  }
+
+  /* fs::weakly_canonical(path(entry)), as the directory components and the
+   * filename component. */
+  const ComponentPath &canonical_dir(uint32_t entry) const {
+    return canonical_dirs_[canonical_dir_[file_[entry]]];
+  }
+  uint32_t canonical_name(uint32_t entry) const {
+    return canonical_name_[file_[entry]];
+  }
+
+  /* Approximately the heap memory used. */
+  size_t memory_usage() const {
+    auto vector_bytes = [](const auto &v) {
+      return v.capacity() * sizeof(v[0]);
+    };
+    size_t bytes = filenames_.memory_usage() + dirs_.memory_usage() +
+                   components_.memory_usage() +
+                   canonical_dir_names_.memory_usage() +
+                   vector_bytes(root_) + vector_bytes(file_) +
+                   vector_bytes(path_dir_) + vector_bytes(filename_id_) +
+                   vector_bytes(relative_dir_) +
+                   vector_bytes(canonical_dir_) +
+                   vector_bytes(canonical_name_) +
+                   vector_bytes(lower_filenames_) +
+                   vector_bytes(by_filename_) + vector_bytes(canonical_dirs_) +
+                   fuzzy_.memory_usage();
+    for (const std::vector<uint32_t> &entries : by_filename_) {
+      bytes += vector_bytes(entries);
+    }
+    for (const ComponentPath &dir : canonical_dirs_) {
+      bytes += vector_bytes(dir);
+    }
+    for (const auto &[path, entry] : by_path_) {
+      bytes += 4 * sizeof(void *) + sizeof(path) + path.capacity() +
+               sizeof(entry);
+    }
+    return bytes;
+  }
+
+private:
+  void reserve(size_t num_headers) {
+    root_.reserve(num_headers);
+    file_.reserve(num_headers);
+    relative_dir_.reserve(num_headers);
+  }
+
+  /* Adds an entry for hdr, of an existing file or of a new one when file
+   * is NOT_FOUND. */
+  void add(uint32_t root, const fs::path &canonical_root, const fs::path &hdr,
+           uint32_t file, const Vfs &vfs) {
+    fs::path canonical;
+    if (file == NOT_FOUND) {
+      file = num_files();
+      canonical = vfs.weakly_canonical(hdr);
+      count(Stat::FsRelativeCalls);
+      fs::path canonical_dir = canonical.parent_path();
+      path_dir_.push_back(dirs_.intern(hdr.parent_path().native()));
+      filename_id_.push_back(intern(hdr.filename().native()));
+      uint32_t dir_id = canonical_dir_names_.intern(canonical_dir.native());
+      if (dir_id == canonical_dirs_.size()) {
+        canonical_dirs_.push_back(components_.intern(canonical_dir));
+      }
+      canonical_dir_.push_back(dir_id);
+      canonical_name_.push_back(
+          components_.intern_name(canonical.filename().native()));
+    } else {
+      canonical = fs::path(canonical_dir_names_[canonical_dir_[file]]) /
+                  components_.name(canonical_name_[file]);
+    }
+    // Same as fs::relative(hdr, root path), with the root only canonicalized
+    // once.
+    fs::path relative = canonical.lexically_relative(canonical_root);
+
+    uint32_t entry = num_entries();
+    root_.push_back(root);
+    file_.push_back(file);
+    relative_dir_.push_back(dirs_.intern(relative.parent_path().native()));
+    by_filename_[filename_id_[file]].push_back(entry);
+  }
+
+  void insert_fuzzy(uint32_t filename_id) {
+    fuzzy_.insert(filename_id, [this](uint32_t a, uint32_t b) {
+      return bounded_levenshtein_distance(key(a), key(b), INT32_MAX);
+    });
+  }
+
+  /* The path lookup for remove() is only built once the index is updated. */
+  void build_by_path() {
+    if (!by_path_built_) {
+      for (uint32_t i = 0; i < num_entries(); ++i) {
+        by_path_.emplace(path(i).string(), i);
+      }
+      by_path_built_ = true;
+    }
+  }
+
+  LevenshteinKey key(uint32_t filename_id) const {
+    return {filenames_[filename_id], lower_filenames_[filename_id]};
+  }
+
+  uint32_t intern(std::string_view filename) {
+    uint32_t id = filenames_.intern(filename);
+    if (id < by_filename_.size()) {
+      return id;
+    }
+    // The lowercase key is stored right behind the filename.
+    lower_filenames_.push_back(filenames_.store(ascii_lower(filename)));
+    by_filename_.emplace_back();
+    if (fuzzy_enabled_) {
+      insert_fuzzy(id);
+    }
+    return id;
+  }
+
+  std::vector<IncludePath> roots_;
+  StringPool filenames_;
+  std::vector<std::string_view> lower_filenames_;
+  std::vector<std::vector<uint32_t>> by_filename_;
+  StringPool dirs_;
+  ComponentTable components_;
+  StringPool canonical_dir_names_;
+  std::vector<ComponentPath> canonical_dirs_;
+  // Per entry.
+  std::vector<uint32_t> root_;         // into roots_
+  std::vector<uint32_t> file_;         // into the per file arrays
+  std::vector<uint32_t> relative_dir_; // into dirs_, relative to the root
+  // Per file.
+  std::vector<uint32_t> path_dir_;       // into dirs_, as first listed
+  std::vector<uint32_t> filename_id_;    // into filenames_
+  std::vector<uint32_t> canonical_dir_;  // into canonical_dirs_
+  std::vector<uint32_t> canonical_name_; // into components_
+  BKTree fuzzy_;
+  bool fuzzy_enabled_{false};
+  std::multimap<std::string, uint32_t> by_path_;
+  bool by_path_built_{false};
+};
@@ -0,0 +1,227 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "report.hpp"
+#include "sfincludes.hpp"
+#include "stats.hpp"
+
+/* The resolved includes of a run, as a graph in compressed sparse row form:
+ * the files included by node n are targets_[offsets_[n]..offsets_[n + 1]).
+ * Nodes are the processed files and the headers they include. */
+class IncludeGraph {
+public:
+  /* Adds the edges from report.file to the headers it reached. Translation
+   * units are the roots of the cost analysis. Must be followed by finish(). */
+  void add(const FileReport &report, bool translation_unit) {
+    uint32_t from = node(report.file);
+    is_translation_unit_[from] = is_translation_unit_[from] || translation_unit;
+    for (const ReachedHeader &header : report.reached) {
+      edges_.push_back({from, node(header.path)});
+    }
+  }
+
+  /* Builds the rows from the added edges, and reads the size of every file. */
+  void finish() {
+    std::sort(edges_.begin(), edges_.end());
+    edges_.erase(std::unique(edges_.begin(), edges_.end()), edges_.end());
+    offsets_.assign(paths_.size() + 1, 0);
+    targets_.resize(edges_.size());
+    for (size_t i = 0; i < edges_.size(); ++i) {
+      offsets_[edges_[i].first + 1]++;
+      targets_[i] = edges_[i].second;
+    }
+    for (size_t n = 0; n < paths_.size(); ++n) {
+      offsets_[n + 1] += offsets_[n];
+    }
+    edges_.clear();
+    edges_.shrink_to_fit();
+    ids_.clear();
+
+    bytes_.resize(paths_.size());
+    for (size_t n = 0; n < paths_.size(); ++n) {
+      std::error_code ec;
+      uintmax_t size = fs::file_size(paths_[n], ec);
+      bytes_[n] = ec ? 0 : size;
+    }
+  }
+
+  size_t num_nodes() const { return paths_.size(); }
+  size_t num_edges() const { return targets_.size(); }
+  const fs::path &path(uint32_t n) const { return paths_[n]; }
+  uint64_t bytes(uint32_t n) const { return bytes_[n]; }
+  bool is_translation_unit(uint32_t n) const {
+    return is_translation_unit_[n];
+  }
+
+  template <typename F> void for_each_include(uint32_t n, F f) const {
+    for (uint32_t e = offsets_[n]; e < offsets_[n + 1]; ++e) {
+      f(targets_[e]);
+    }
+  }
+
+private:
+  uint32_t node(const fs::path &file) {
+    fs::path path = file.lexically_normal();
+    auto [it, added] = ids_.emplace(path.string(), uint32_t(paths_.size()));
+    if (added) {
+      paths_.push_back(std::move(path));
+      is_translation_unit_.push_back(false);
+    }
+    return it->second;
+  }
+
+  std::vector<fs::path> paths_;
+  std::vector<bool> is_translation_unit_;
+  std::vector<uint64_t> bytes_;
+  std::vector<uint32_t> offsets_;
+  std::vector<uint32_t> targets_;
+  // Only while adding.
+  std::unordered_map<std::string, uint32_t> ids_;
+  std::vector<std::pair<uint32_t, uint32_t>> edges_;
+};
+
+/* What a file costs the build. The closure of a file is everything it pulls
+ * in, itself included, as the preprocessor would read it once. */
+struct IncludeCost {
+  uint32_t fan_in{0};            // files including it directly
+  uint32_t closure_files{0};     // files in its closure
+  uint64_t closure_bytes{0};     // bytes in its closure
+  uint32_t translation_units{0}; // translation units with it in their closure
+
+  /* The bytes compiled because of this header, over all translation units:
+   * an upper bound, as part of its closure may be pulled in anyway. */
+  uint64_t build_bytes() const {
+    return uint64_t(translation_units) * closure_bytes;
+  }
+};
+
+/* Computes the cost of every node of graph on jobs threads. The closure of
+ * each node is walked once, and shared by its own numbers and those of the
+ * translation units it counts towards. */
+inline std::vector<IncludeCost> analyze_include_cost(const IncludeGraph &graph,
+                                                     int jobs) {
+  PhaseTimer phase(Phase::Analysis);
+  size_t num_nodes = graph.num_nodes();
+  std::vector<IncludeCost> costs(num_nodes);
+  for (uint32_t n = 0; n < num_nodes; ++n) {
+    graph.for_each_include(n, [&](uint32_t to) { costs[to].fan_in++; });
+  }
+
+  int num_threads = std::max(1, std::min<int>(jobs, num_nodes));
+  std::vector<std::vector<uint32_t>> reached_by_tus(num_threads);
+  std::atomic<uint32_t> next_node{0};
+  auto worker = [&](int t) {
+    std::vector<uint32_t> &tus = reached_by_tus[t];
+    tus.assign(num_nodes, 0);
+    /* Visited marks are stamped with the root, so they never need clearing. */
+    std::vector<uint32_t> visited(num_nodes, UINT32_MAX);
+    std::vector<uint32_t> stack;
+    uint32_t root;
+    while ((root = next_node++) < num_nodes) {
+      bool tu = graph.is_translation_unit(root);
+      IncludeCost &cost = costs[root];
+      stack.push_back(root);
+      visited[root] = root;
+      while (!stack.empty()) {
+        uint32_t n = stack.back();
+        stack.pop_back();
+        cost.closure_files++;
+        cost.closure_bytes += graph.bytes(n);
+        tus[n] += tu;
+        graph.for_each_include(n, [&](uint32_t to) {
+          if (visited[to] != root) {
+            visited[to] = root;
+            stack.push_back(to);
+          }
+        });
+      }
+    }
+  };
+  std::vector<std::thread> threads;
+  for (int t = 1; t < num_threads; ++t) {
+    threads.emplace_back([&, t]() {
+      worker(t);
+      flush_thread_stats();
+    });
+  }
+  worker(0);
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  for (const std::vector<uint32_t> &tus : reached_by_tus) {
+    for (uint32_t n = 0; n < tus.size(); ++n) {
+      costs[n].translation_units += tus[n];
+    }
+  }
+  return costs;
+}
+
+/* Prints the totals per translation unit, and the top headers by
+ * IncludeCost::build_bytes(). */
+inline void print_include_cost(std::ostream &out, const IncludeGraph &graph,
+                               const std::vector<IncludeCost> &costs,
+                               size_t top) {
+  auto kb = [](uint64_t bytes) {
+    std::ostringstream s;
+    s << std::fixed << std::setprecision(1) << bytes / 1024.0;
+    return s.str();
+  };
+  size_t num_tus = 0;
+  uint64_t tu_files = 0, tu_bytes = 0;
+  std::vector<uint32_t> headers;
+  for (uint32_t n = 0; n < graph.num_nodes(); ++n) {
+    if (graph.is_translation_unit(n)) {
+      num_tus++;
+      tu_files += costs[n].closure_files;
+      tu_bytes += costs[n].closure_bytes;
+    } else if (costs[n].fan_in > 0) {
+      headers.push_back(n);
+    }
+  }
+  out << "[Include cost]" << std::endl;
+  out << "Files        : " << graph.num_nodes() << " (" << num_tus
+      << " translation units, " << headers.size() << " included headers)"
+      << std::endl;
+  out << "Includes     : " << graph.num_edges() << " (resolved, distinct)"
+      << std::endl;
+  out << "Preprocessed : " << tu_files << " files, " << kb(tu_bytes)
+      << " kB over all translation units";
+  if (num_tus) {
+    out << " (" << tu_files / num_tus << " files, " << kb(tu_bytes / num_tus)
+        << " kB each on average)";
+  }
+  out << std::endl;
+
+  top = std::min(top, headers.size());
+  std::partial_sort(headers.begin(), headers.begin() + top, headers.end(),
+                    [&](uint32_t a, uint32_t b) {
+                      if (costs[a].build_bytes() != costs[b].build_bytes()) {
+                        return costs[a].build_bytes() > costs[b].build_bytes();
+                      }
+                      return graph.path(a) < graph.path(b);
+                    });
+  out << std::endl;
+  out << "Most expensive headers (build kB = TUs x closure kB):" << std::endl;
+  out << std::setw(10) << "build kB" << std::setw(7) << "TUs" << std::setw(8)
+      << "fan-in" << std::setw(9) << "closure" << std::setw(12) << "closure kB"
+      << "  header" << std::endl;
+  for (size_t i = 0; i < top; ++i) {
+    const IncludeCost &cost = costs[headers[i]];
+    out << std::setw(10) << kb(cost.build_bytes()) << std::setw(7)
+        << cost.translation_units << std::setw(8) << cost.fan_in
+        << std::setw(9) << cost.closure_files << std::setw(12)
+        << kb(cost.closure_bytes) << "  " << graph.path(headers[i]).string()
+        << std::endl;
+  }
+}
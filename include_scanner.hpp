@@ -0,0 +1,260 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* The first of the bytes a, b, c and d in [p, end), or end. Compares 16 bytes
+ * at a time where SSE2 is available. */
+inline const char *find_first_of(const char *p, const char *end, char a,
+                                 char b, char c, char d) {
+#if defined(__SSE2__)
+  const __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b),
+                vc = _mm_set1_epi8(c), vd = _mm_set1_epi8(d);
+  for (; end - p >= 16; p += 16) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    __m128i ab = _mm_or_si128(_mm_cmpeq_epi8(x, va), _mm_cmpeq_epi8(x, vb));
+    __m128i cd = _mm_or_si128(_mm_cmpeq_epi8(x, vc), _mm_cmpeq_epi8(x, vd));
+    __m128i hits = _mm_or_si128(ab, cd);
+    if (int mask = _mm_movemask_epi8(hits)) {
+      return p + __builtin_ctz(mask);
+    }
+  }
+#endif
+  for (; p < end; ++p) {
+    if (*p == a || *p == b || *p == c || *p == d) {
+      return p;
+    }
+  }
+  return end;
+}
+
+/* Skips the lexical elements of C and C++ that can hide a directive, as far
+ * as for_each_directive_line() needs to. */
+namespace lexer {
+
+inline bool is_identifier_char(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         (c >= '0' && c <= '9') || c == '_';
+}
+
+inline bool is_blank(char c) {
+  return c == ' ' || c == '\t' || c == '\f' || c == '\v' || c == '\r';
+}
+
+/* The end of the line p is on: its '\n', or end. */
+inline const char *end_of_line(const char *p, const char *end) {
+  return find_first_of(p, end, '\n', '\n', '\n', '\n');
+}
+
+/* Whether p only has blanks before it on its line. */
+inline bool at_line_start(const char *begin, const char *p) {
+  while (p > begin && is_blank(p[-1])) {
+    --p;
+  }
+  return p == begin || p[-1] == '\n';
+}
+
+/* The start of the identifier or number that ends right before p. */
+inline const char *token_before(const char *begin, const char *p) {
+  while (p > begin && (is_identifier_char(p[-1]) || p[-1] == '.' ||
+                       p[-1] == '\'')) {
+    --p;
+  }
+  return p;
+}
+
+/* From behind the //: to the end of the line, which a backslash extends. */
+inline const char *skip_line_comment(const char *p, const char *end) {
+  for (;;) {
+    const char *eol = end_of_line(p, end);
+    const char *last = eol;
+    if (last > p && last[-1] == '\r') {
+      --last;
+    }
+    if (eol == end || last == p || last[-1] != '\\') {
+      return eol;
+    }
+    p = eol + 1;
+  }
+}
+
+/* From behind the / *: to behind the closing * /, or end. */
+inline const char *skip_block_comment(const char *p, const char *end) {
+  // Looks for the '/', which is much rarer in comments than the '*'.
+  for (const char *q = p; q < end; ++q) {
+    q = find_first_of(q, end, '/', '/', '/', '/');
+    if (q > p && q < end && q[-1] == '*') {
+      return q + 1;
+    }
+  }
+  return end;
+}
+
+/* From behind the opening quote: to behind the closing one. Literals do not
+ * span lines, so an unterminated one (such as an apostrophe in #error text)
+ * ends at the newline. */
+inline const char *skip_quoted(const char *p, const char *end, char quote) {
+  while (p < end) {
+    p = find_first_of(p, end, quote, '\\', '\n', quote);
+    if (p == end || *p == '\n') {
+      return p;
+    }
+    if (*p == quote) {
+      return p + 1;
+    }
+    p += 2; // Escape, or a backslash continuing the line.
+  }
+  return end;
+}
+
+/* From behind the opening quote of R"delim( ... )delim": to behind the
+ * closing one. nullptr if it is not a valid raw string opening. */
+inline const char *skip_raw_string(const char *p, const char *end) {
+  const char *open = p;
+  while (open < end && open - p <= 16 && *open != '(') {
+    if (*open == ')' || *open == '\\' || *open == '"' || is_blank(*open) ||
+        *open == '\n') {
+      return nullptr;
+    }
+    ++open;
+  }
+  if (open == end || *open != '(') {
+    return nullptr;
+  }
+  std::string closing = ")" + std::string(p, open) + "\"";
+  std::string_view rest(open + 1, end - open - 1);
+  size_t found = rest.find(closing);
+  return found == std::string_view::npos ? end
+                                         : rest.data() + found + closing.size();
+}
+
+/* Whether the quote at p opens a raw string: R, LR, uR, UR or u8R before it. */
+inline bool is_raw_string(const char *begin, const char *p) {
+  if (p == begin || p[-1] != 'R') {
+    return false;
+  }
+  const char *token = token_before(begin, p);
+  std::string_view prefix(token, p - token);
+  return prefix == "R" || prefix == "LR" || prefix == "uR" ||
+         prefix == "UR" || prefix == "u8R";
+}
+
+/* Whether the apostrophe at p separates digits (1'000), rather than opening
+ * a character literal. */
+inline bool is_digit_separator(const char *begin, const char *p) {
+  const char *token = token_before(begin, p);
+  return token < p && ((*token >= '0' && *token <= '9') ||
+                       (*token == '.' && token + 1 < p && token[1] >= '0' &&
+                        token[1] <= '9'));
+}
+
+/* From the '#' of a directive: behind the header name if it is an #include
+ * or #include_next, whose <a//b.h> is not a comment. Else behind the blanks
+ * after the '#'. */
+inline const char *skip_header_name(const char *hash, const char *eol) {
+  const char *p = hash + 1;
+  while (p < eol && is_blank(*p)) {
+    ++p;
+  }
+  const std::string_view include = "include";
+  if (size_t(eol - p) <= include.size() ||
+      std::memcmp(p, include.data(), include.size()) != 0) {
+    return p;
+  }
+  p += include.size();
+  while (p < eol && (is_identifier_char(*p) || is_blank(*p))) {
+    ++p; // _next, and the blanks before the header name
+  }
+  if (p == eol || *p != '<') {
+    return p;
+  }
+  const char *close =
+      static_cast<const char *>(std::memchr(p + 1, '>', eol - p - 1));
+  return close ? close + 1 : eol;
+}
+
+} // namespace lexer
+
+/* Calls on_line(offset, line) for every preprocessor directive in text: every
+ * line whose first non-blank character is a '#', unless it is inside a
+ * comment or a raw string literal. The line starts at the '#', and excludes
+ * the terminating newline.
+ *
+ * Only the bytes that can start a directive, comment or literal are looked
+ * at, 16 at a time; the insides of comments and literals are skipped with
+ * memchr. */
+template <typename OnLine>
+void for_each_directive_line(std::string_view text, OnLine &&on_line) {
+  using namespace lexer;
+  const char *begin = text.data();
+  const char *end = begin + text.size();
+  const char *p = begin;
+  while ((p = find_first_of(p, end, '#', '/', '"', '\'')) < end) {
+    switch (*p) {
+    case '#':
+      if (at_line_start(begin, p)) {
+        const char *eol = end_of_line(p, end);
+        on_line(size_t(p - begin), std::string_view(p, eol - p));
+        p = skip_header_name(p, eol);
+      } else {
+        ++p;
+      }
+      break;
+    case '/':
+      if (p + 1 < end && p[1] == '/') {
+        p = skip_line_comment(p + 2, end);
+      } else if (p + 1 < end && p[1] == '*') {
+        p = skip_block_comment(p + 2, end);
+      } else {
+        ++p;
+      }
+      break;
+    case '"':
+      if (const char *raw = is_raw_string(begin, p)
+                                ? skip_raw_string(p + 1, end)
+                                : nullptr) {
+        p = raw;
+      } else {
+        p = skip_quoted(p + 1, end, '"');
+      }
+      break;
+    default: // '\''
+      p = is_digit_separator(begin, p) ? p + 1 : skip_quoted(p + 1, end, '\'');
+      break;
+    }
+  }
+}
+
+/* Replacement of the bytes [offset, offset + length) of a file. */
+struct TextEdit {
+  size_t offset{};
+  size_t length{};
+  std::string replacement{};
+};
+
+/* Returns text with all edits applied. The edits must be sorted and must not
+ * overlap. */
+inline std::string apply_edits(std::string_view text,
+                               const std::vector<TextEdit> &edits) {
+  std::string result;
+  size_t size = text.size();
+  for (const TextEdit &e : edits) {
+    size += e.replacement.size() - e.length;
+  }
+  result.reserve(size);
+  size_t pos = 0;
+  for (const TextEdit &e : edits) {
+    result.append(text.substr(pos, e.offset - pos));
+    result.append(e.replacement);
+    pos = e.offset + e.length;
+  }
+  result.append(text.substr(pos));
+  return result;
+}
@@ -0,0 +1,297 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "mapped_file.hpp"
+#include "sfincludes.hpp"
+#include "stats.hpp"
+#include "traversal.hpp"
+
+/* Persistent cache of the directory listings walked by find_headers, such that
+ * a warm start only needs one stat() per directory instead of reading all of
+ * them. A directory's mtime changes whenever an entry is added, removed or
+ * renamed in it, so a listing is reused as long as the mtime is unchanged.
+ * Subdirectories are validated by their own mtime.
+ *
+ * The listings keep the order in which the directory iterator returned the
+ * entries, so the headers come out in exactly the same order as an uncached
+ * walk.
+ *
+ * File layout (native byte order; it is a local cache, not an exchange
+ * format):
+ *
+ *   FileHeader
+ *   DirRecord[num_dirs]
+ *   EntryRecord[num_entries]
+ *   char strings[strings_size]
+ */
+class IndexCache {
+public:
+  /* Loads the cache file. A missing or unreadable file is an empty cache. */
+  void load(const fs::path &cache_file) {
+    file_ = std::make_unique<MappedFile>(cache_file);
+    std::string_view data = file_->view();
+    FileHeader header;
+    if (data.size() < sizeof(header)) {
+      return;
+    }
+    std::memcpy(&header, data.data(), sizeof(header));
+    if (std::memcmp(header.magic, MAGIC, sizeof(header.magic)) != 0 ||
+        data.size() != sizeof(header) + header.num_dirs * sizeof(DirRecord) +
+                           header.num_entries * sizeof(EntryRecord) +
+                           header.strings_size) {
+      return;
+    }
+    const char *dirs = data.data() + sizeof(header);
+    const char *entries = dirs + header.num_dirs * sizeof(DirRecord);
+    const char *strings = entries + header.num_entries * sizeof(EntryRecord);
+    auto string_at = [&](uint32_t offset, uint32_t length) {
+      return offset + length <= header.strings_size
+                 ? std::string_view(strings + offset, length)
+                 : std::string_view();
+    };
+
+    saved_at_ = header.saved_at;
+    for (uint64_t d = 0; d < header.num_dirs; ++d) {
+      DirRecord dir;
+      std::memcpy(&dir, dirs + d * sizeof(DirRecord), sizeof(dir));
+      if (uint64_t(dir.first_entry) + dir.num_entries > header.num_entries) {
+        continue;
+      }
+      StoredDir stored{dir.mtime, {}};
+      for (uint32_t e = 0; e < dir.num_entries; ++e) {
+        EntryRecord entry;
+        std::memcpy(&entry,
+                    entries + (dir.first_entry + e) * sizeof(EntryRecord),
+                    sizeof(entry));
+        stored.entries.push_back(
+            {string_at(entry.name_offset, entry.name_length), entry.flags});
+      }
+      stored_[string_at(dir.path_offset, dir.path_length)] =
+          std::move(stored);
+    }
+  }
+
+  /* Same result as find_headers(dir, headers, options), but only lists
+   * directories which changed since the cache was saved. A .gitignore is
+   * only read where the listing has one. */
+  void find_headers(const fs::path &dir, std::vector<std::string> &headers,
+                    const Options &options) {
+    IgnoreStack ignore(options, dir);
+    find_headers(dir, "", 0, 0, ignore, options, headers);
+  }
+
+  /* Writes all listings used by find_headers() since load(). Skipped if
+   * nothing changed. The file is replaced atomically. */
+  void save(const fs::path &cache_file) {
+    if (num_rescanned_ == 0 && listings_.size() == stored_.size()) {
+      return;
+    }
+    FileHeader header;
+    std::memcpy(header.magic, MAGIC, sizeof(header.magic));
+    header.saved_at = now();
+    std::vector<DirRecord> dirs;
+    std::vector<EntryRecord> entries;
+    std::string strings;
+    auto add_string = [&](std::string_view s, uint32_t *offset,
+                          uint32_t *length) {
+      *offset = strings.size();
+      *length = s.size();
+      strings.append(s);
+    };
+    for (const auto &[path, listing] : listings_) {
+      DirRecord dir{};
+      dir.mtime = listing.mtime;
+      dir.first_entry = entries.size();
+      dir.num_entries = listing.entries.size();
+      add_string(path, &dir.path_offset, &dir.path_length);
+      for (const Entry &entry : listing.entries) {
+        EntryRecord record{};
+        record.flags = entry.flags;
+        add_string(entry.name, &record.name_offset, &record.name_length);
+        entries.push_back(record);
+      }
+      dirs.push_back(dir);
+    }
+    header.num_dirs = dirs.size();
+    header.num_entries = entries.size();
+    header.strings_size = strings.size();
+
+    fs::path tmp = cache_file;
+    tmp += ".tmp";
+    {
+      std::ofstream out(tmp, std::ios::binary);
+      out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+      out.write(reinterpret_cast<const char *>(dirs.data()),
+                dirs.size() * sizeof(DirRecord));
+      out.write(reinterpret_cast<const char *>(entries.data()),
+                entries.size() * sizeof(EntryRecord));
+      out.write(strings.data(), strings.size());
+      if (!out) {
+        return;
+      }
+    }
+    file_.reset(); // Unmap before replacing the file.
+    fs::rename(tmp, cache_file);
+  }
+
+  /* Distinct directories listed since load(), from the cache or not. */
+  size_t num_reused() const { return listings_.size() - num_rescanned_; }
+  size_t num_rescanned() const { return num_rescanned_; }
+
+private:
+  static constexpr char MAGIC[8] = {'S', 'F', 'I', 'D', 'X', '0', '0', '2'};
+  // A directory modified this close to saving the cache might have been
+  // modified again within the same mtime tick, so it is not trusted.
+  static constexpr int64_t RACY_SECONDS = 2;
+
+  enum : uint32_t {
+    HEADER = 1,
+    DIRECTORY = 2,
+    DIRECTORY_SYMLINK = 4,
+    GITIGNORE = 8
+  };
+
+  struct FileHeader {
+    char magic[8];
+    int64_t saved_at;
+    uint64_t num_dirs;
+    uint64_t num_entries;
+    uint64_t strings_size;
+  };
+  struct DirRecord {
+    int64_t mtime;
+    uint32_t path_offset;
+    uint32_t path_length;
+    uint32_t first_entry;
+    uint32_t num_entries;
+  };
+  struct EntryRecord {
+    uint32_t name_offset;
+    uint32_t name_length;
+    uint32_t flags;
+  };
+
+  struct Entry {
+    std::string name;
+    uint32_t flags;
+  };
+  struct Listing {
+    int64_t mtime{0};
+    std::vector<Entry> entries{};
+    bool rescanned{false}; // read from the disk at least once
+  };
+  struct StoredEntry {
+    std::string_view name; // Points into the mapped cache file.
+    uint32_t flags;
+  };
+  struct StoredDir {
+    int64_t mtime;
+    std::vector<StoredEntry> entries;
+  };
+
+  static int64_t ticks(fs::file_time_type t) {
+    return t.time_since_epoch().count();
+  }
+  static int64_t now() { return ticks(fs::file_time_type::clock::now()); }
+  static int64_t racy_ticks() {
+    return std::chrono::duration_cast<fs::file_time_type::duration>(
+               std::chrono::seconds(RACY_SECONDS))
+        .count();
+  }
+
+  /* The walk of walk_tree(): entries of dir are depth levels below the root,
+   * with symlinks directory symlinks followed on the way there. */
+  void find_headers(const fs::path &dir, const std::string &relative,
+                    int depth, int symlinks, IgnoreStack &ignore,
+                    const Options &options, std::vector<std::string> &headers) {
+    const Listing &listing = list(dir);
+    if (depth > 0) {
+      bool has_gitignore = std::any_of(
+          listing.entries.begin(), listing.entries.end(),
+          [](const Entry &entry) { return entry.flags & GITIGNORE; });
+      ignore.enter(dir, relative, depth, has_gitignore);
+    }
+    std::string entry_relative;
+    for (const Entry &entry : listing.entries) {
+      bool is_dir = entry.flags & (DIRECTORY | DIRECTORY_SYMLINK);
+      if (!is_dir && !(entry.flags & HEADER)) {
+        continue;
+      }
+      entry_relative = relative.empty() ? entry.name
+                                        : relative + "/" + entry.name;
+      if (ignore.ignored(entry_relative, is_dir)) {
+        count(is_dir ? Stat::SkippedDirectories : Stat::SkippedFiles);
+        continue;
+      }
+      fs::path path = dir / entry.name;
+      if (!is_dir) {
+        headers.push_back(path.string());
+        continue;
+      }
+      int followed = symlinks + (entry.flags & DIRECTORY_SYMLINK ? 1 : 0);
+      if (followed <= options.follow_symlinks) {
+        find_headers(path, entry_relative, depth + 1, followed, ignore,
+                     options, headers);
+        ignore.leave(depth);
+      }
+    }
+  }
+
+  /* Nested include paths reach the same directories again: a listing of
+   * this run is reused as is, unless the directory changed since. */
+  const Listing &list(const fs::path &dir) {
+    std::string key = dir.string();
+    int64_t mtime = ticks(fs::last_write_time(dir));
+    auto [found, added] = listings_.try_emplace(key);
+    Listing &listing = found->second;
+    if (!added && listing.mtime == mtime) {
+      return listing;
+    }
+    listing.mtime = mtime;
+    listing.entries.clear();
+
+    auto it = stored_.find(key);
+    if (it != stored_.end() && it->second.mtime == mtime &&
+        mtime < saved_at_ - racy_ticks()) {
+      for (const StoredEntry &e : it->second.entries) {
+        listing.entries.push_back({std::string(e.name), e.flags});
+      }
+      return listing;
+    }
+
+    if (!listing.rescanned) {
+      listing.rescanned = true;
+      num_rescanned_++;
+    }
+    for (const fs::directory_entry &e : fs::directory_iterator(dir)) {
+      uint32_t flags = 0;
+      if (e.is_directory()) {
+        flags |= e.is_symlink() ? DIRECTORY_SYMLINK : DIRECTORY;
+      } else if (has_header_extension(e.path())) {
+        flags |= HEADER;
+      } else if (e.path().filename() == ".gitignore") {
+        flags |= GITIGNORE;
+      }
+      if (flags != 0) {
+        listing.entries.push_back({e.path().filename().string(), flags});
+      }
+    }
+    return listing;
+  }
+
+  std::unique_ptr<MappedFile> file_;
+  int64_t saved_at_{0};
+  std::unordered_map<std::string_view, StoredDir> stored_;
+  std::unordered_map<std::string, Listing> listings_;
+  size_t num_rescanned_{0};
+};
@@ -1,7 +1,17 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
 #include <numeric>
 #include <string>
+#include <string_view>
+#include <vector>
+
+#include "stats.hpp"
 
-int levenshtein_distance(const std::string &s1, const std::string &s2) {
+/* Reference implementation: full O(n*m) dynamic programming. Prefer
+ * bounded_levenshtein_distance() below, which computes the same distance. */
+inline int levenshtein_distance(const std::string &s1, const std::string &s2) {
   // To change the type this function manipulates and returns, change
   // the return type and the types of the two variables below.
   int s1len = s1.size();
@@ -47,3 +57,177 @@ int levenshtein_distance(const std::string &s1, const std::string &s2) {
   delete[] column;
   return result;
 }
+
+
+/* A string together with its ASCII-lowercased copy, such that the distance
+ * kernel does not need to call std::tolower for every cell. */
+struct LevenshteinKey {
+  std::string_view text;
+  std::string_view lower; // Same length as text.
+};
+
+inline std::string ascii_lower(std::string_view s) {
+  std::string lower(s);
+  for (char &c : lower) {
+    if (c >= 'A' && c <= 'Z') {
+      c = c - 'A' + 'a';
+    }
+  }
+  return lower;
+}
+
+/* Myers' bit-parallel unit-cost edit distance between the lowercased keys.
+ * Requires the shorter string (pattern) to be at most 64 characters. Every
+ * edit of the weighted distance costs at least 1 and maps onto at most one
+ * unit-cost edit of the lowercased strings, so this is a lower bound on the
+ * weighted distance. */
+inline int unit_levenshtein_lower(std::string_view pattern,
+                                  std::string_view text) {
+  thread_local uint64_t peq[256] = {};
+  const int m = pattern.size();
+  for (int i = 0; i < m; ++i) {
+    peq[(unsigned char)pattern[i]] |= uint64_t(1) << i;
+  }
+  const uint64_t high = uint64_t(1) << (m - 1);
+  uint64_t pv = ~uint64_t(0);
+  uint64_t mv = 0;
+  int score = m;
+  for (char c : text) {
+    uint64_t eq = peq[(unsigned char)c];
+    uint64_t xv = eq | mv;
+    uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+    uint64_t ph = mv | ~(xh | pv);
+    uint64_t mh = pv & xh;
+    if (ph & high) {
+      score++;
+    } else if (mh & high) {
+      score--;
+    }
+    ph = (ph << 1) | 1;
+    mh <<= 1;
+    pv = mh | ~(xv | ph);
+    mv = ph & xv;
+  }
+  for (int i = 0; i < m; ++i) {
+    peq[(unsigned char)pattern[i]] = 0;
+  }
+  return score;
+}
+
+/* Same distance as levenshtein_distance() (costs: insert=4, change=2,
+ * capitalize=1, and 1 per leading insertion), but gives up as soon as the
+ * result is known to exceed max_distance, in which case max_distance + 1 is
+ * returned.
+ *
+ *  - The length difference alone costs at least 1 per character.
+ *  - For short strings, a bit-parallel lower bound rejects many pairs
+ *    without running the weighted DP at all.
+ *  - The DP only evaluates the diagonals that can stay within max_distance
+ *    (Ukkonen), and stops when a whole row exceeds it.
+ *  - The DP row lives on the stack for typical header names, and in a
+ *    thread-local buffer otherwise, so there is no allocation per call. */
+inline int bounded_levenshtein_distance(LevenshteinKey a, LevenshteinKey b,
+                                        int max_distance) {
+  constexpr int insert_cost = 4;
+  constexpr int change_cost = 2;
+  constexpr int capitalize_cost = 1;
+
+  count(Stat::LevenshteinCalls);
+  if (a.text.size() > b.text.size()) {
+    std::swap(a, b);
+  }
+  const int n = a.text.size(); // rows: the shorter string
+  const int m = b.text.size();
+  const int delta = m - n;
+  // Deleting all of a up front and inserting all of b is always possible.
+  max_distance = std::min(max_distance, n + insert_cost * m);
+  const int inf = max_distance + 1;
+  if (max_distance < 0 || delta > max_distance) {
+    return inf;
+  }
+  if (a.text == b.text) {
+    return 0;
+  }
+  if (n == 0) {
+    return m;
+  }
+  if (n <= 64 && unit_levenshtein_lower(a.lower, b.lower) > max_distance) {
+    return inf;
+  }
+
+  /* A path through diagonal t = j - i costs at least |t| to get there (only
+   * leading insertions cost 1, others cost 4), and 4 per diagonal to still
+   * end on diagonal delta. Only [t_lo, t_hi] can stay within max_distance. */
+  auto floor_div = [](int x, int y) { return x >= 0 ? x / y : -((-x + y - 1) / y); };
+  auto ceil_div = [&](int x, int y) { return -floor_div(-x, y); };
+  const int t_hi = floor_div(max_distance + insert_cost * delta, insert_cost + 1);
+  const int t_lo = insert_cost * delta - max_distance <= 0
+                       ? ceil_div(insert_cost * delta - max_distance, insert_cost + 1)
+                       : ceil_div(insert_cost * delta - max_distance, insert_cost - 1);
+
+  constexpr int STACK_ROW = 256;
+  int stack_row[STACK_ROW];
+  thread_local std::vector<int> heap_row;
+  int *row = stack_row;
+  if (m + 1 > STACK_ROW) {
+    heap_row.resize(m + 1);
+    row = heap_row.data();
+  }
+
+  for (int j = 0; j <= m; ++j) {
+    row[j] = j <= t_hi ? j : inf;
+  }
+
+  for (int i = 1; i <= n; ++i) {
+    const int jlo = std::max(1, i + t_lo);
+    const int jhi = std::min(m, i + t_hi);
+    if (jlo > jhi) {
+      return inf;
+    }
+    count(Stat::LevenshteinCells, jhi - jlo + 1);
+    const char c1 = a.text[i - 1];
+    const char l1 = a.lower[i - 1];
+
+    int diagonal = row[jlo - 1];
+    int left = (jlo == 1 && -i >= t_lo) ? i : inf;
+    row[jlo - 1] = left;
+    int row_min = left;
+    for (int j = jlo; j <= jhi; ++j) {
+      int diff_cost;
+      if (c1 == b.text[j - 1]) {
+        diff_cost = 0;
+      } else if (l1 == b.lower[j - 1]) {
+        diff_cost = capitalize_cost;
+      } else {
+        diff_cost = change_cost;
+      }
+      int up = row[j];
+      // clang-format off
+      int value = std::min({
+        up + insert_cost,
+        left + insert_cost,
+        diagonal + diff_cost,
+        inf
+      });
+      // clang-format on
+      diagonal = up;
+      row[j] = value;
+      left = value;
+      row_min = std::min(row_min, value);
+    }
+    if (row_min > max_distance) {
+      return inf;
+    }
+  }
+  return row[m];
+}
+
+/* Convenience overload for strings without a precomputed lowercase key. */
+inline int bounded_levenshtein_distance(std::string_view a, std::string_view b,
+                                        int max_distance) {
+  thread_local std::string a_lower, b_lower;
+  a_lower = ascii_lower(a);
+  b_lower = ascii_lower(b);
+  return bounded_levenshtein_distance({a, a_lower}, {b, b_lower},
+                                      max_distance);
+}
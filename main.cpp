@@ -1,103 +1,93 @@
 #include <algorithm>
-#include <boost/algorithm/string/predicate.hpp>
 #include <boost/program_options.hpp>
+#include <boost/property_tree/json_parser.hpp>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
-#include <map>
-#include <sstream>
+#include <memory>
+#include <optional>
+#include <set>
 #include <string>
+#include <thread>
 #include <vector>
 
-#include "levenshtein_distance.hpp"
+#include "compile_commands.hpp"
+#include "include_graph.hpp"
+#include "index_cache.hpp"
+#include "move_map.hpp"
+#include "report.hpp"
+#include "report_sink.hpp"
+#include "resolver.hpp"
+#include "server.hpp"
+#include "watcher.hpp"
+#include "sfincludes.hpp"
+#include "shard.hpp"
+#include "stats.hpp"
+#include "write_back.hpp"
 
 namespace po = boost::program_options;
-namespace fs = std::filesystem;
-
-struct ProcessResult {
-  size_t total{0};
-  size_t replaced_path{0};
-  size_t system_to_user{0};
-  size_t user_to_system{0};
-  size_t untouched{0};
-  size_t failed{0};
-};
 
-void accumulate(ProcessResult *r, const ProcessResult &term) {
-  r->total += term.total;
-  r->replaced_path += term.replaced_path;
-  r->system_to_user += term.system_to_user;
-  r->user_to_system += term.user_to_system;
-  r->untouched += term.untouched;
-  r->failed += term.failed;
+void rename_headers(std::vector<std::string> &headers, WriteBack &write_back);
+
+/* Human readable progress and summary messages go to console_out, the
+ * include report to report_out. Both are redirected to a ReportSink once the
+ * options are parsed. */
+std::ostream console_out(std::cout.rdbuf());
+std::ostream report_out(std::cout.rdbuf());
+std::unique_ptr<ReportWriter> report_writer;
+bool report_ended = false;
+
+/* Ends the report begun in main(), once. */
+void end_report(const ProcessResult &summary) {
+  if (!report_ended) {
+    report_writer->end(report_out, summary);
+    report_ended = true;
+  }
 }
 
-struct IncludePath {
-  fs::path path;
-  bool system{false};
-
-  bool operator<(const IncludePath &other) const { return path < other.path; }
-};
-
-struct IncludeStmt {
-  std::string path;
-  bool system{false};
-};
-
-struct Candidate {
-  IncludePath search_path{};
-  std::string header{};
-  int filename_distance{};
-  int folder_distance{};
-
-  int weighted_distance() const {
-    return filename_distance * 200 + folder_distance;
-  }
+/* Ends the report on the way out of main() when a run stops at an error, so
+ * that a JSON or SARIF report is still a complete document. */
+struct ReportScope {
+  ReportScope() { report_writer->begin(report_out); }
+  ~ReportScope() { end_report(ProcessResult{}); }
+  ReportScope(const ReportScope &) = delete;
+  ReportScope &operator=(const ReportScope &) = delete;
 };
 
-void find_headers(fs::path dir, std::vector<fs::path> &headers);
-
-void rename_headers(std::vector<fs::path> &headers);
-
-ProcessResult
-process_dir(fs::path dir, const std::vector<IncludePath> &include_paths,
-            const std::map<IncludePath, std::vector<fs::path>> &headers);
-
-void process_file(fs::path file, const std::vector<IncludePath> &include_paths,
-                  const std::map<IncludePath, std::vector<fs::path>> &headers,
-                  ProcessResult *result);
-
-std::vector<Candidate>
-fix_include(const IncludeStmt &path, const fs::path &file,
-            const std::vector<IncludePath> &include_paths,
-            const std::map<IncludePath, std::vector<fs::path>> &headers,
-            bool prefer_relative_to_root);
-
-int fuzzy = 0;
-bool dry_run = true;
-bool verbose = false;
-bool process_system_includes = false;
-bool system_to_user = false;
-bool user_to_system = false;
-bool prefer_relative_to_root = false;
-bool omit_untouched = false;
-bool omit_system_failed = false;
-
-const std::string RED = "\033[31m";
-const std::string GREEN = "\033[32m";
-const std::string YELLOW = "\033[33m";
-const std::string BLUE = "\033[34m";
-const std::string DIM = "\033[2m";
-const std::string CLEAR = "\033[0m";
+/* With --shard, the partial result is written alongside the report. */
+std::ofstream shard_out;
+std::unique_ptr<ReportWriter> shard_writer;
 
+void write_file_report(const FileReport &report);
 void print_results(const ProcessResult &result);
+bool commit(WriteBack &write_back, const fs::path &journal_dir, int jobs);
+int merge(const std::vector<std::string> &shard_paths, bool dry_run,
+          const fs::path &journal_dir, int jobs);
 
 int main(int argc, char **argv) {
+  int64_t start_wall_ns = wall_clock_ns();
   po::options_description desc("Allowed options");
 
   std::vector<std::string> src_paths;
   std::vector<std::string> user_include_paths;
   std::vector<std::string> sys_include_paths;
+  std::string index_cache_path;
+  std::string stats_json_path;
+  std::string report_format_name = "text";
+  std::string report_output_path = "-";
+  std::string serve_path;
+  std::string compile_commands_path;
+  size_t include_cost_top = 0;
+  std::string undo_journal_path = ".sfincludes-undo";
+  std::string move_map_path;
+  std::string old_headers_path;
+  std::string old_revision;
+  std::vector<std::string> exclude_patterns;
+  std::string shard_spec;
+  std::string shard_output_path;
+  std::vector<std::string> merge_paths;
+  std::string header_index_path;
+  std::string write_header_index_path;
 
   // clang-format off
   desc.add_options()
@@ -108,8 +98,37 @@ int main(int argc, char **argv) {
        "Add user include search path directory (cfr. gcc -Ipath) [repeat --user-include-path to specify more]")
       ("sys-include-path", po::value<std::vector<std::string>>(&sys_include_paths),
        "Add system include search path directory (cfr. gcc -isystem). [repeat --sys-include-path to specify more]")
+      ("compile-commands", po::value<std::string>(&compile_commands_path),
+       "Process the translation units in this compilation database (compile_commands.json) "
+       "and the headers they include, with their own include paths, instead of --src.")
+      ("exclude", po::value<std::vector<std::string>>(&exclude_patterns),
+       "Skip the files and directories matching this .gitignore style pattern in the source "
+       "and include directories. [repeat --exclude to specify more]")
+      ("no-gitignore", "Also look in the files and directories ignored by .gitignore files.")
+      ("follow-symlinks", po::value<int>()->default_value(0),
+       "Follow directory symlinks, up to this many in a row.")
+      ("index-cache", po::value<std::string>(&index_cache_path),
+       "Cache the header search in this file. Only directories which changed since the previous run are listed again.")
+      ("write-header-index", po::value<std::string>(&write_header_index_path),
+       "Write the headers found in the include paths to this file, to be shared by --header-index runs. "
+       "Without sources, exit after writing it.")
+      ("header-index", po::value<std::string>(&header_index_path),
+       "Take the headers of the include paths from this file, written by --write-header-index, "
+       "instead of searching them.")
+      ("move-map", po::value<std::string>(&move_map_path),
+       "Rewrite includes of moved headers from this list of old and new paths: tab separated, "
+       "git diff --name-status -M output, or JSON. Other includes are resolved as usual.")
+      ("old-headers", po::value<std::string>(&old_headers_path),
+       "Find headers that were moved and renamed by their contents: an include that matches no "
+       "header is looked up by the contents of its old version in this directory (an old checkout).")
+      ("old-revision", po::value<std::string>(&old_revision),
+       "Same as --old-headers, with the old versions from this revision of the git repository in "
+       "the working directory.")
       ("fuzzy", po::value<int>()->default_value(0),
        "Maximal filename edit distance (costs: insert=4, change=2, capitalize=1).")
+      ("max-alternatives", po::value<int>()->default_value(-1),
+       "Number of alternatives to the chosen header that are ranked and reported (-1: all). "
+       "Fewer skip more path distance computations for common header names.")
       ("process-system-includes", "Also process #include <> statements.")
       ("system-to-user",
        "Replace #include <> with #include \"\" when the file is found user include search path. "
@@ -120,6 +139,35 @@ int main(int argc, char **argv) {
        "Also rewrite correct includes to be relative to their corresponding search path root.")
       ("rename-hpp", "Rename .h headers files to .hpp.")
       ("no-dry-run", "Actually perform the changes.")
+      ("undo", "Restore the files changed by the last run with --no-dry-run, and exit.")
+      ("undo-journal", po::value<std::string>(&undo_journal_path),
+       "Directory where --no-dry-run records how to undo its changes. (Default: .sfincludes-undo)")
+      ("shard", po::value<std::string>(&shard_spec),
+       "Only process shard i of N (given as i/N) of the source files, split by a hash of their path, "
+       "and write the partial result for --merge instead of changing files.")
+      ("shard-output", po::value<std::string>(&shard_output_path),
+       "File the partial result of --shard is written to. (Default: sfincludes-shard-i-of-N.jsonl)")
+      ("merge", po::value<std::vector<std::string>>(&merge_paths)->multitoken(),
+       "Combine the partial results of all shards into one report, apply them with --no-dry-run, and exit.")
+      ("jobs,j", po::value<int>()->default_value(1),
+       "Number of threads processing source files (0: one per core).")
+      ("stats", "Report time per phase and internal counters.")
+      ("stats-json", po::value<std::string>(&stats_json_path),
+       "Write the --stats report as JSON to this file (- for stdout).")
+      ("report-format", po::value<std::string>(&report_format_name),
+       "Format of the include report: text, jsonl (JSON Lines) or sarif.")
+      ("report-output", po::value<std::string>(&report_output_path),
+       "Write the include report to this file (- for stdout). A jsonl or sarif "
+       "report on stdout moves all other messages to stderr.")
+      ("serve", po::value<std::string>(&serve_path),
+       "Keep the header index in memory and answer resolve and fix requests on "
+       "this Unix domain socket, instead of processing --src.")
+      ("watch", "After processing --src, keep watching the include paths and "
+       "sources, and fix the files affected by headers being created, removed "
+       "or moved.")
+      ("include-cost", po::value<size_t>(&include_cost_top),
+       "Instead of fixing includes, follow them from every source file (or translation unit "
+       "of --compile-commands) and rank this many headers by what they add to compile times.")
       ("verbose", "Be verbose.")
       ("omit-untouched", "Do not list the untouched includes. Useful for reviewing.")
       ("omit-system-failed", "Do not list the system includes which were not resolved. Useful for reviewing.")
@@ -135,46 +183,141 @@ int main(int argc, char **argv) {
     return 1;
   }
 
+  std::optional<ReportFormat> report_format =
+      parse_report_format(report_format_name);
+  if (!report_format) {
+    std::cout << RED << "ERROR: Unknown report format: " << report_format_name
+              << CLEAR << std::endl;
+    return 1;
+  }
+  report_writer = make_report_writer(*report_format);
+
+  /* Writing is done by background threads, which are drained when these go
+   * out of scope, in reverse order. */
+  ReportSink stdout_sink(stdout);
+  SinkStreamBuf stdout_buf(stdout_sink);
+  std::unique_ptr<std::FILE, int (*)(std::FILE *)> report_file(nullptr,
+                                                              &std::fclose);
+  std::unique_ptr<ReportSink> report_sink;
+  std::unique_ptr<SinkStreamBuf> report_buf;
+  console_out.rdbuf(&stdout_buf);
+  if (report_output_path != "-") {
+    report_file.reset(std::fopen(report_output_path.c_str(), "wb"));
+    if (!report_file) {
+      console_out << RED << "ERROR: Cannot write report: "
+                  << report_output_path << CLEAR << std::endl;
+      return 1;
+    }
+    report_sink = std::make_unique<ReportSink>(report_file.get());
+    report_buf = std::make_unique<SinkStreamBuf>(*report_sink);
+    report_out.rdbuf(report_buf.get());
+  } else {
+    report_out.rdbuf(&stdout_buf);
+    if (*report_format != ReportFormat::Text) {
+      console_out.rdbuf(std::cerr.rdbuf());
+    }
+  }
+
+  /* An undo reports nothing. */
+  if (vm.count("undo")) {
+    int jobs = vm["jobs"].as<int>();
+    if (jobs <= 0) {
+      jobs = std::max(1u, std::thread::hardware_concurrency());
+    }
+    return undo_write_back(undo_journal_path, jobs, console_out) ? 0 : 1;
+  }
+  ReportScope report_scope;
+  if (!merge_paths.empty()) {
+    int jobs = vm["jobs"].as<int>();
+    if (jobs <= 0) {
+      jobs = std::max(1u, std::thread::hardware_concurrency());
+    }
+    return merge(merge_paths, !vm.count("no-dry-run"), undo_journal_path,
+                 jobs);
+  }
+
+  Options options;
   bool rename = false;
 
   std::vector<IncludePath> include_paths;
 
   if (user_include_paths.size()) {
     for (auto &p : user_include_paths) {
-      std::cout << "User inlucde path : " << p << std::endl;
+      console_out << "User inlucde path : " << p << std::endl;
       include_paths.push_back({p, false});
     }
   } else {
-    std::cout << "No user include paths given." << std::endl;
+    console_out << "No user include paths given." << std::endl;
   }
   if (sys_include_paths.size()) {
     for (auto &p : sys_include_paths) {
-      std::cout << "System inlucde path : " << p << std::endl;
+      console_out << "System inlucde path : " << p << std::endl;
       include_paths.push_back({p, true});
     }
   } else {
-    std::cout << "No system include paths given." << std::endl;
+    console_out << "No system include paths given." << std::endl;
+  }
+
+  /* Translation units come with their own include paths, which are all
+   * indexed. Those which do not exist (yet) are skipped. */
+  std::vector<SourceTask> translation_units;
+  if (!compile_commands_path.empty()) {
+    try {
+      translation_units =
+          load_compile_commands(compile_commands_path, include_paths);
+    } catch (const boost::property_tree::ptree_error &e) {
+      console_out << RED << "ERROR: Cannot read compilation database: "
+                  << e.what() << CLEAR << std::endl;
+      return 1;
+    }
+    size_t num_given = include_paths.size();
+    std::set<fs::path> known;
+    for (const IncludePath &inc : include_paths) {
+      known.insert(inc.path);
+    }
+    for (const SourceTask &tu : translation_units) {
+      for (const IncludePath &inc : *tu.include_paths) {
+        if (known.insert(inc.path).second && fs::is_directory(inc.path)) {
+          include_paths.push_back(inc);
+        }
+      }
+    }
+    console_out << "Compilation database : " << compile_commands_path << " ("
+                << translation_units.size() << " translation units, "
+                << include_paths.size() - num_given << " include paths)"
+                << std::endl;
   }
   if (include_paths.empty()) {
-    std::cout << RED << "ERROR: No include paths given." << CLEAR << std::endl;
-    std::cout << desc << std::endl;
+    console_out << RED << "ERROR: No include paths given." << CLEAR
+                << std::endl;
+    console_out << desc << std::endl;
     return 1;
   }
 
   bool good = true;
-  if (vm.count("src")) {
+  bool index_only = false;
+  if (!serve_path.empty()) {
+    console_out << "Serve : " << serve_path << std::endl;
+  } else if (!compile_commands_path.empty()) {
+    for (const std::string &src : src_paths) {
+      console_out << "Ignored source (using --compile-commands) : " << src
+                  << std::endl;
+    }
+  } else if (vm.count("src")) {
     for (const std::string &src : src_paths) {
       if (fs::is_directory(src)) {
-        std::cout << "Source : " << src << std::endl;
+        console_out << "Source : " << src << std::endl;
       } else {
-        std::cout << RED << "ERROR: Source directory not found: " << src
-                  << CLEAR << std::endl;
+        console_out << RED << "ERROR: Source directory not found: " << src
+                    << CLEAR << std::endl;
         good = false;
       }
     }
+  } else if (!write_header_index_path.empty()) {
+    index_only = true;
   } else {
-    std::cout << RED << "ERROR: Source not set." << CLEAR << std::endl;
-    std::cout << desc << std::endl;
+    console_out << RED << "ERROR: Source not set." << CLEAR << std::endl;
+    console_out << desc << std::endl;
     good = false;
   }
   if (!good) {
@@ -182,112 +325,423 @@ int main(int argc, char **argv) {
   }
 
   if (vm.count("process-system-includes")) {
-    process_system_includes = true;
-    std::cout << "Process system includes." << std::endl;
+    options.process_system_includes = true;
+    console_out << "Process system includes." << std::endl;
   }
   if (vm.count("system-to-user")) {
-    system_to_user = true;
-    std::cout << "Convert system includes to user includes when a "
-                 "corresponding file is found in the user include search path."
-              << std::endl;
+    options.system_to_user = true;
+    console_out
+        << "Convert system includes to user includes when a corresponding "
+           "file is found in the user include search path."
+        << std::endl;
   }
   if (vm.count("user-to-system")) {
-    user_to_system = true;
-    std::cout
+    options.user_to_system = true;
+    console_out
         << "Convert user includes to system includes when a corresponding file "
            "is found in the system include search path."
         << std::endl;
   }
   if (vm.count("prefer-relative-to-root")) {
-    prefer_relative_to_root = true;
-    std::cout
+    options.prefer_relative_to_root = true;
+    console_out
         << "Prefer include paths to be always written relative to the root."
         << std::endl;
   }
   if (vm.count("omit-untouched")) {
-    omit_untouched = true;
-    std::cout << "Will omit reporting untouched includes." << std::endl;
+    options.omit_untouched = true;
+    console_out << "Will omit reporting untouched includes." << std::endl;
   }
   if (vm.count("omit-system-failed")) {
-    omit_system_failed = true;
-    std::cout << "Will omit reporting system includes which were not resolved."
-              << std::endl;
+    options.omit_system_failed = true;
+    console_out
+        << "Will omit reporting system includes which were not resolved."
+        << std::endl;
   }
 
   if (vm.count("fuzzy")) {
-    fuzzy = vm["fuzzy"].as<int>();
-    std::cout << "Fuzzy search : " << fuzzy << std::endl;
+    options.fuzzy = vm["fuzzy"].as<int>();
+    console_out << "Fuzzy search : " << options.fuzzy << std::endl;
+  }
+  options.max_alternatives = vm["max-alternatives"].as<int>();
+  options.exclude = exclude_patterns;
+  for (const std::string &pattern : exclude_patterns) {
+    console_out << "Exclude : " << pattern << std::endl;
+  }
+  if (vm.count("no-gitignore")) {
+    options.gitignore = false;
+    console_out << "Not using .gitignore files." << std::endl;
+  }
+  options.follow_symlinks = vm["follow-symlinks"].as<int>();
+  if (options.follow_symlinks > 0) {
+    console_out << "Follow directory symlinks : " << options.follow_symlinks
+                << " in a row" << std::endl;
+  }
+
+  std::optional<MoveMap> move_map;
+  if (!move_map_path.empty()) {
+    try {
+      move_map = load_move_map(move_map_path);
+    } catch (const std::runtime_error &e) {
+      console_out << RED << "ERROR: Cannot read move map: " << e.what()
+                  << CLEAR << std::endl;
+      return 1;
+    }
+    console_out << "Move map : " << move_map_path << " (" << move_map->size()
+                << " moved headers)" << std::endl;
+  }
+
+  options.jobs = vm["jobs"].as<int>();
+  if (options.jobs <= 0) {
+    options.jobs = std::max(1u, std::thread::hardware_concurrency());
+  }
+  if (options.jobs > 1) {
+    console_out << "Jobs : " << options.jobs << std::endl;
+  }
+
+  std::optional<ContentMatcher> content_matcher;
+  if (!old_headers_path.empty() || !old_revision.empty()) {
+    PhaseTimer phase(Phase::Index);
+    content_matcher.emplace();
+    try {
+      if (!old_headers_path.empty()) {
+        add_old_headers(*content_matcher, old_headers_path, options);
+      }
+      if (!old_revision.empty()) {
+        add_old_headers_from_git(*content_matcher, old_revision, options.jobs);
+      }
+    } catch (const std::runtime_error &e) {
+      console_out << RED << "ERROR: Cannot read the old headers: " << e.what()
+                  << CLEAR << std::endl;
+      return 1;
+    }
+    console_out << "Old headers : " << content_matcher->num_old()
+                << " (to match missing headers by their contents)"
+                << std::endl;
   }
 
   if (vm.count("rename-hpp")) {
     rename = true;
-    std::cout << "Rename to hpp." << std::endl;
+    console_out << "Rename to hpp." << std::endl;
+  }
+
+  bool include_cost = vm.count("include-cost");
+  if (include_cost && vm.count("no-dry-run")) {
+    console_out << RED << "ERROR: --include-cost does not write changes."
+                << CLEAR << std::endl;
+    return 1;
+  }
+  if (include_cost) {
+    options.record_includes = true;
+    console_out << "Include cost: top " << include_cost_top << " headers."
+                << std::endl;
+  }
+
+  if (!shard_spec.empty()) {
+    if (!parse_shard(shard_spec, &options.shard, &options.num_shards)) {
+      console_out << RED << "ERROR: Expected --shard i/N, with i < N: "
+                  << shard_spec << CLEAR << std::endl;
+      return 1;
+    }
+    if (vm.count("no-dry-run") || include_cost || !serve_path.empty() ||
+        vm.count("watch")) {
+      console_out << RED
+                  << "ERROR: --shard only writes a partial result. Use "
+                     "--merge --no-dry-run to apply it."
+                  << CLEAR << std::endl;
+      return 1;
+    }
+    if (shard_output_path.empty()) {
+      shard_output_path = "sfincludes-shard-" +
+                          std::to_string(options.shard) + "-of-" +
+                          std::to_string(options.num_shards) + ".jsonl";
+    }
+    shard_out.open(shard_output_path, std::ios::binary | std::ios::trunc);
+    if (!shard_out) {
+      console_out << RED << "ERROR: Cannot write the partial result: "
+                  << shard_output_path << CLEAR << std::endl;
+      return 1;
+    }
+    options.record_edits = true;
+    shard_writer =
+        std::make_unique<ShardResultWriter>(options.shard, options.num_shards);
+    shard_writer->begin(shard_out);
+    console_out << "Shard : " << options.shard << "/" << options.num_shards
+                << " (partial result: " << shard_output_path << ")"
+                << std::endl;
   }
 
   if (vm.count("no-dry-run")) {
-    dry_run = false;
-    std::cout << "No dry run." << std::endl;
+    options.dry_run = false;
+    console_out << "No dry run." << std::endl;
   } else {
-    std::cout << "Dry run. (Use --no-dry-run to effectively write changes back "
-                 "to filesystem.)"
-              << std::endl;
+    console_out << "Dry run. (Use --no-dry-run to effectively write changes "
+                   "back to filesystem.)"
+                << std::endl;
+  }
+
+  if (vm.count("stats") || !stats_json_path.empty()) {
+    stats_enabled = true;
   }
 
   if (vm.count("verbose")) {
-    verbose = true;
-    std::cout << "Be verbose." << std::endl;
+    options.verbose = true;
+    console_out << "Be verbose." << std::endl;
   }
 
   for (auto &inc : include_paths) {
     if (!fs::is_directory(fs::path(inc.path))) {
-      std::cout << RED << "Include path does not exist." << std::endl;
-      std::cout << inc.path << CLEAR << std::endl;
+      console_out << RED << "Include path does not exist." << std::endl;
+      console_out << inc.path << CLEAR << std::endl;
       return 1;
     }
   }
 
-  std::cout << std::endl;
+  console_out << std::endl;
 
-  std::map<IncludePath, std::vector<fs::path>> headers;
-  for (auto &inc : include_paths) {
-    std::cout << "Index headers in: " << inc.path << std::endl;
-    std::vector<fs::path> hdrs;
-    find_headers(inc.path, hdrs);
-    if (verbose) {
+  std::optional<PhaseTimer> phase(Phase::Index);
+  IndexCache index_cache;
+  if (!index_cache_path.empty()) {
+    index_cache.load(index_cache_path);
+  }
+
+  HeaderMap prebuilt;
+  if (!header_index_path.empty()) {
+    try {
+      prebuilt = load_header_index(header_index_path);
+    } catch (const std::runtime_error &e) {
+      console_out << RED << "ERROR: Cannot read header index: " << e.what()
+                  << CLEAR << std::endl;
+      return 1;
+    }
+  }
+
+  /* The include paths and source directories are listed together: those
+   * nested in or overlapping with another one are not walked again. The
+   * index cache lists each include path on its own. */
+  bool index_only_headers = !index_cache_path.empty();
+  bool walk_sources = serve_path.empty() && !index_only &&
+                      (compile_commands_path.empty() || include_cost);
+  std::vector<WalkRoot> walk_roots;
+  std::vector<size_t> walk_root_of(include_paths.size(), SIZE_MAX);
+  for (size_t i = 0; i < include_paths.size(); ++i) {
+    if (!prebuilt.count(include_paths[i]) && !index_only_headers) {
+      walk_root_of[i] = walk_roots.size();
+      walk_roots.push_back({include_paths[i].path, has_header_extension});
+    }
+  }
+  size_t first_source_root = walk_roots.size();
+  if (walk_sources) {
+    for (const std::string &src : src_paths) {
+      walk_roots.push_back({src, has_source_extension});
+    }
+  }
+  phase.emplace(Phase::Traversal);
+  std::vector<std::vector<std::string>> listed =
+      walk_trees(walk_roots, options);
+  phase.emplace(Phase::Index);
+  std::vector<std::vector<fs::path>> sources(src_paths.size());
+  for (size_t i = first_source_root; i < walk_roots.size(); ++i) {
+    sources[i - first_source_root].assign(listed[i].begin(), listed[i].end());
+  }
+
+  HeaderMap headers;
+  size_t num_prebuilt = 0;
+  for (size_t i = 0; i < include_paths.size(); ++i) {
+    const IncludePath &inc = include_paths[i];
+    console_out << "Index headers in: " << inc.path << std::endl;
+    std::vector<std::string> hdrs;
+    if (auto it = prebuilt.find(inc); it != prebuilt.end()) {
+      hdrs = std::move(it->second);
+      num_prebuilt++;
+    } else if (index_only_headers) {
+      index_cache.find_headers(inc.path, hdrs, options);
+    } else {
+      hdrs = std::move(listed[walk_root_of[i]]);
+    }
+    if (options.verbose) {
       for (auto &f : hdrs) {
-        std::cout << "    " << fs::relative(f, inc.path) << std::endl;
+        console_out << "    " << fs::relative(f, inc.path) << std::endl;
+        count(Stat::FsRelativeCalls);
       }
     }
     headers[inc] = std::move(hdrs);
   }
+  if (!index_cache_path.empty()) {
+    console_out << "Index cache: " << index_cache.num_reused()
+                << " directories reused, " << index_cache.num_rescanned()
+                << " rescanned." << std::endl;
+    index_cache.save(index_cache_path);
+  }
+  if (!header_index_path.empty()) {
+    console_out << "Header index : " << num_prebuilt << " of "
+                << include_paths.size() << " include paths read from "
+                << header_index_path << std::endl;
+  }
+  if (!write_header_index_path.empty()) {
+    if (!save_header_index(write_header_index_path, headers)) {
+      console_out << RED << "ERROR: Cannot write header index: "
+                  << write_header_index_path << CLEAR << std::endl;
+      return 1;
+    }
+    console_out << "Header index written : " << write_header_index_path
+                << std::endl;
+    if (index_only) {
+      return 0;
+    }
+  }
+  /* All changes are staged, and only written once everything is processed.
+   * Includes are resolved as if the renames were done, also in a dry run. */
+  WriteBack write_back;
+  auto commit = [&]() {
+    return options.dry_run ||
+           ::commit(write_back, undo_journal_path, options.jobs);
+  };
+  phase.emplace(Phase::Rename);
   if (rename) {
     for (auto &e : headers) {
       if (!e.first.system) {
-        rename_headers(e.second);
+        rename_headers(e.second, write_back);
       }
     }
   }
 
-  std::cout << std::endl;
+  /* Indexing and resolution list every directory they look into once, and
+   * then answer from memory. Once the changes are committed, the snapshot
+   * is stale. */
+  phase.emplace(Phase::Index);
+  SnapshotVfs snapshot;
+  Resolver resolver(options, include_paths, std::move(headers), snapshot);
+  resolver.set_write_back(&write_back);
+  if (move_map) {
+    resolver.set_move_map(&*move_map);
+  }
+  if (content_matcher) {
+    content_matcher->fingerprint_headers(resolver.index(), options.jobs);
+    resolver.set_content_matcher(&*content_matcher);
+  }
+  phase.reset();
+  if (stats_enabled) {
+    console_out << "Header index : " << resolver.index().num_entries()
+                << " headers, " << resolver.index().num_filenames()
+                << " filenames, " << resolver.index().memory_usage() / 1024
+                << " kB" << std::endl;
+  }
+
+  if (!serve_path.empty()) {
+    if (!commit()) {
+      return 1;
+    }
+    resolver.set_write_back(nullptr);
+    resolver.set_vfs(disk_vfs());
+    return serve(resolver, serve_path, console_out);
+  }
+
+  console_out << std::endl;
 
   ProcessResult accum{};
-  for (const std::string &src : src_paths) {
-    std::cout << std::endl;
-    std::cout << "Processing source directory: " << src << "..." << std::endl;
-    ProcessResult result = process_dir(src, include_paths, headers);
+  if (include_cost) {
+    /* All sources are roots of one traversal, so that every header is
+     * processed once. */
+    std::vector<SourceTask> tasks = translation_units;
+    for (std::vector<fs::path> &files : sources) {
+      for (fs::path &file : files) {
+        tasks.push_back({std::move(file)});
+      }
+    }
+    std::set<std::string> roots;
+    for (const SourceTask &task : tasks) {
+      if (!has_header_extension(task.file)) {
+        roots.insert(task.file.lexically_normal().string());
+      }
+    }
+    console_out << std::endl;
+    console_out << "Following includes from " << roots.size()
+                << " translation units..." << std::endl;
+    IncludeGraph graph;
+    accum = resolver.process_reachable(tasks, [&](const FileReport &report) {
+      graph.add(report, roots.count(report.file.lexically_normal().string()));
+    });
+    graph.finish();
+    std::vector<IncludeCost> costs =
+        analyze_include_cost(graph, options.jobs);
+    console_out << std::endl;
+    print_include_cost(console_out, graph, costs, include_cost_top);
+    src_paths.clear();
+  } else if (!compile_commands_path.empty()) {
+    console_out << std::endl;
+    console_out << "Processing translation units..." << std::endl;
+    accum =
+        resolver.process_reachable(translation_units, write_file_report);
+    src_paths.clear();
+  }
+  for (size_t i = 0; i < src_paths.size(); ++i) {
+    const std::string &src = src_paths[i];
+    console_out << std::endl;
+    console_out << "Processing source directory: " << src << "..." << std::endl;
+    ProcessResult result =
+        resolver.process_sources(std::move(sources[i]), write_file_report);
     if (src_paths.size() > 1) {
-      std::cout << std::endl;
+      console_out << std::endl;
       print_results(result);
     }
     accumulate(&accum, result);
   }
-  std::cout << std::endl;
-  std::cout << "[Summary]" << std::endl;
+  bool committed = commit();
+  resolver.set_write_back(nullptr);
+  resolver.set_vfs(disk_vfs());
+  console_out << std::endl;
+  console_out << "[Summary]" << std::endl;
   print_results(accum);
+  uint64_t skipped_dirs = stat_total(Stat::SkippedDirectories);
+  uint64_t skipped_files = stat_total(Stat::SkippedFiles);
+  if (skipped_dirs || skipped_files) {
+    console_out << "Skipped      : " << skipped_dirs << " directories, "
+                << skipped_files
+                << " files (ignored by .gitignore or --exclude)" << std::endl;
+  }
+  console_out << DIM << "Resolution cache: "
+              << resolver.cache().candidates.hits() << " hits, "
+              << resolver.cache().candidates.misses() << " misses"
+              << " (header lookup: " << resolver.cache().matches.hits()
+              << " hits, " << resolver.cache().matches.misses() << " misses)"
+              << CLEAR << std::endl;
+  end_report(accum);
+  if (shard_writer) {
+    shard_writer->end(shard_out, accum);
+    shard_out.close();
+    if (!shard_out) {
+      console_out << RED << "ERROR: Cannot write the partial result: "
+                  << shard_output_path << CLEAR << std::endl;
+      return 1;
+    }
+  }
+
+  if (stats_enabled) {
+    ProcessStats ps = process_stats(start_wall_ns);
+    console_out << std::endl;
+    if (vm.count("stats")) {
+      print_stats(console_out, ps);
+    }
+    if (stats_json_path == "-") {
+      print_stats_json(console_out, ps);
+    } else if (!stats_json_path.empty()) {
+      std::ofstream json(stats_json_path);
+      print_stats_json(json, ps);
+    }
+  }
 
-  std::cout << std::endl;
-  if (dry_run) {
-    std::cout
+  console_out << std::endl;
+  if (!committed) {
+    return 1;
+  } else if (include_cost) {
+    return 0;
+  } else if (shard_writer) {
+    console_out << "Partial result written to " << shard_output_path
+                << ". Combine all shards with --merge." << std::endl;
+    return 0;
+  } else if (options.dry_run) {
+    console_out
         << YELLOW
         << "⚠\ufe0f Always backup / git commit your work before applying with "
            "--no-dry-run. ⚠\ufe0f"
@@ -295,284 +749,129 @@ int main(int argc, char **argv) {
         << "Carefully review the changed above before continuing." << CLEAR
         << std::endl;
   } else {
-    std::cout << YELLOW
-              << "⚠\ufe0f Restart your editor to prevent it from resaving the "
-                 "files you moved away. ⚠\ufe0f"
-              << CLEAR << std::endl;
+    console_out << YELLOW
+                << "⚠\ufe0f Restart your editor to prevent it from resaving "
+                   "the files you moved away. ⚠\ufe0f"
+                << CLEAR << std::endl;
   }
 
-  return 0;
-}
-
-void find_headers(fs::path dir, std::vector<fs::path> &headers) {
-  const std::vector<std::string> HDR_EXT = {".h", ".hpp"};
-  for (fs::recursive_directory_iterator it(dir);
-       it != fs::recursive_directory_iterator(); ++it) {
-    fs::path file = it->path();
-    if (std::find(HDR_EXT.begin(), HDR_EXT.end(), file.extension()) !=
-        HDR_EXT.end()) {
-      headers.push_back(file);
-    }
+  if (vm.count("watch")) {
+    console_out << std::endl;
+    std::vector<fs::path> source_dirs(src_paths.begin(), src_paths.end());
+    return watch(
+        resolver, source_dirs,
+        [](const FileReport &report) {
+          report_writer->file(report_out, report);
+          report_out.flush();
+        },
+        console_out);
   }
+
+  return 0;
 }
 
-void rename_headers(std::vector<fs::path> &headers) {
+void rename_headers(std::vector<std::string> &headers, WriteBack &write_back) {
   for (auto &hdr : headers) {
     fs::path newpath = hdr;
     newpath = newpath.replace_extension(".hpp");
-    if (newpath != hdr) {
-      std::cout << GREEN << "🏷\ufe0f Rename: " << hdr << "  ->  " << newpath
-                << CLEAR << std::endl;
-      if (!dry_run) {
-        fs::rename(hdr, newpath);
+    if (newpath.native() != hdr && write_back.exists(newpath)) {
+      console_out << YELLOW << "Not renaming " << hdr << ": " << newpath
+                  << " exists already." << CLEAR << std::endl;
+    } else if (newpath.native() != hdr) {
+      report_writer->rename(report_out, hdr, newpath);
+      if (shard_writer) {
+        shard_writer->rename(shard_out, hdr, newpath);
       }
-      hdr = newpath;
+      write_back.rename(hdr, newpath);
+      hdr = newpath.string();
     }
   }
 }
 
-void print_results(const ProcessResult &result) {
-  std::cout << "Replaced path: " << result.replaced_path << " / "
-            << result.total << std::endl;
-  std::cout << "Sys-to-user  : " << result.system_to_user << " / "
-            << result.total << std::endl;
-  std::cout << "User-to-sys  : " << result.user_to_system << " / "
-            << result.total << std::endl;
-  std::cout << "Untouched    : " << result.untouched << " / " << result.total
-            << std::endl;
-  std::cout << "Failed       : " << result.failed << " / " << result.total
-            << std::endl;
-  std::cout << CLEAR;
+void write_file_report(const FileReport &report) {
+  report_writer->file(report_out, report);
+  if (shard_writer) {
+    shard_writer->file(shard_out, report);
+  }
 }
 
-ProcessResult
-process_dir(fs::path dir, const std::vector<IncludePath> &include_paths,
-            const std::map<IncludePath, std::vector<fs::path>> &headers) {
-  const std::vector<std::string> EXT = {".cpp", ".cxx", ".cc", ".h", ".hpp"};
-
-  ProcessResult result{};
-
-  for (fs::recursive_directory_iterator it(dir);
-       it != fs::recursive_directory_iterator(); ++it) {
-    fs::path file = it->path();
-    if (std::find(EXT.begin(), EXT.end(), file.extension()) != EXT.end()) {
-      process_file(file, include_paths, headers, &result);
-    }
+/* Writes the staged changes, with an undo journal in journal_dir. */
+bool commit(WriteBack &write_back, const fs::path &journal_dir, int jobs) {
+  if (write_back.empty()) {
+    return true;
   }
-
-  return result;
+  console_out << std::endl;
+  console_out << "Writing " << write_back.num_writes() << " files and "
+              << write_back.num_renames() << " renames..." << std::endl;
+  if (!write_back.commit(journal_dir, jobs, console_out)) {
+    return false;
+  }
+  console_out << "Undo journal : " << journal_dir.string()
+              << " (use --undo to restore the previous state)" << std::endl;
+  return true;
 }
 
-void process_file(fs::path file, const std::vector<IncludePath> &include_paths,
-                  const std::map<IncludePath, std::vector<fs::path>> &headers,
-                  ProcessResult *result) {
-  std::cout << "    Process " << file.string() << " ..." << std::endl;
-  std::stringstream buffer;
-  std::ifstream in(file.string());
-  std::string line;
-  while (std::getline(in, line, '\n')) {
-    std::string prefix_all = "#include ";
-    std::string prefix_system = "#include <";
-    std::string prefix_user = "#include \"";
-    if (boost::starts_with(line, prefix_user) ||
-        (boost::starts_with(line, prefix_system) && process_system_includes)) {
-      (result->total)++;
-
-      std::string path, behind_path, path_with_quotes;
-      size_t endPathPos = 0;
-      bool system = false;
-      if (boost::starts_with(line, prefix_user)) {
-        endPathPos = line.find("\"", prefix_user.size());
-        system = false;
-      } else if (boost::starts_with(line, prefix_system)) {
-        endPathPos = line.find(">", prefix_system.size());
-        system = true;
-      }
-
-      path = line.substr(prefix_user.size(), endPathPos - prefix_user.size());
-      path_with_quotes =
-          line.substr(prefix_all.size(), endPathPos - prefix_all.size() + 1);
-      behind_path = line.substr(endPathPos + 1);
-
-      IncludeStmt current{path, system};
-      std::vector<Candidate> candidate_fixes = fix_include(
-          current, file, include_paths, headers, prefer_relative_to_root);
-
-      if (!candidate_fixes.empty()) {
-        Candidate fix = candidate_fixes[0];
-        std::string fixed_path_with_quotes;
-        bool emit_system_include = false;
-        if ((system && fix.search_path.system) || // already good
-            (!system && fix.search_path.system &&
-             user_to_system) || // changed to system
-            (system && !fix.search_path.system &&
-             !user_to_system)) { // can't touch
-          emit_system_include = true;
-        }
-
-        if (emit_system_include) {
-          fixed_path_with_quotes = "<" + fix.header + ">";
-        } else {
-          fixed_path_with_quotes = "\"" + fix.header + "\"";
-        }
-
-        bool changed_include_type = system != emit_system_include;
-        if (changed_include_type) {
-          if (system) {
-            result->system_to_user++;
-          } else {
-            result->user_to_system++;
-          }
-        }
-
-        buffer << "#include " << fixed_path_with_quotes << behind_path
-               << std::endl;
-        if (fix.header != path) {
-          (result->replaced_path)++;
-
-          std::cout << YELLOW
-                    << "        👕 Replace include path: " << path_with_quotes;
-          std::cout << "  ->  " << fixed_path_with_quotes;
-          std::cout << DIM << "  (distance: fn=" << fix.filename_distance
-                    << "; dir=" << fix.folder_distance << ") from "
-                    << fix.search_path.path << CLEAR << std::endl;
-        } else if (changed_include_type) {
-          std::cout << BLUE
-                    << "        💄 Change include type: " << path_with_quotes;
-          std::cout << "  ->  " << fixed_path_with_quotes << CLEAR << std::endl;
-        } else {
-          (result->untouched)++;
-
-          if (omit_untouched) {
-            continue; // the line is written.
-          }
-          std::cout << GREEN
-                    << "        ✅ Untouched include: " << path_with_quotes
-                    << CLEAR << std::endl;
-        }
-
-        for (int alt_idx = 1; alt_idx < candidate_fixes.size(); ++alt_idx) {
-          Candidate &alt = candidate_fixes[alt_idx];
-          std::cout << DIM << "           - Alternative: " << alt.header;
-          std::cout << DIM << "  (distance: fn=" << alt.filename_distance
-                    << "; dir=" << alt.folder_distance << ") from "
-                    << alt.search_path.path << CLEAR << std::endl;
-        }
-
-      } else {
-        buffer << line << std::endl;
-        (result->failed)++;
-
-        if (omit_system_failed && system) {
-          continue; // the line is written.
-        }
-        std::cout << RED
-                  << "        ❓ Failed to fix include: " << path_with_quotes
+/* Reports and, unless dry_run, applies the partial results of all shards of
+ * a run as one. */
+int merge(const std::vector<std::string> &shard_paths, bool dry_run,
+          const fs::path &journal_dir, int jobs) {
+  std::vector<ShardResult> shards;
+  for (const std::string &path : shard_paths) {
+    try {
+      shards.push_back(load_shard_result(path));
+    } catch (const std::runtime_error &e) {
+      console_out << RED << "ERROR: Cannot read partial result: " << e.what()
                   << CLEAR << std::endl;
-      }
-    } else {
-      buffer << line << std::endl;
+      return 1;
     }
+    console_out << "Partial result : " << path << " (shard "
+                << shards.back().shard << "/" << shards.back().num_shards
+                << ", " << shards.back().files.size() << " files)"
+                << std::endl;
   }
-  in.close();
-
-  if (!dry_run) {
-    std::ofstream out(file.string());
-    out << buffer.str();
-    out.close();
+  std::optional<ShardResult> merged =
+      merge_shard_results(std::move(shards), console_out);
+  if (!merged) {
+    return 1;
   }
-}
-
-int calculate_path_distance(const fs::path &containing_file,
-                            const IncludeStmt &current,
-                            const std::string &candidate_include,
-                            const IncludePath &candidate_search_path) {
-  int dist_relative = 9999999;
-  {
-    fs::path full_path = candidate_search_path.path / candidate_include;
-    fs::path relative_to_file = fs::relative(full_path, containing_file);
-    if (relative_to_file != full_path) {
-      dist_relative =
-          levenshtein_distance(current.path, relative_to_file.string());
-    }
+  console_out << std::endl;
+  for (const auto &[from, to] : merged->renames) {
+    report_writer->rename(report_out, from, to);
   }
-
-  int dist_root = levenshtein_distance(current.path, candidate_include);
-  return std::min(dist_relative, dist_root);
-}
-
-std::vector<Candidate>
-fix_include(const IncludeStmt &include, const fs::path &file,
-            const std::vector<IncludePath> &include_paths,
-            const std::map<IncludePath, std::vector<fs::path>> &headers,
-            bool prefer_relative_to_root) {
-  std::vector<Candidate> candidates;
-
-  fs::path dir = file.parent_path();
-  if (!include.system) {
-    /* Check if the file is in this directory */
-    fs::path local = dir / include.path;
-    if (fs::exists(local)) {
-      if (prefer_relative_to_root) {
-        // First find a root to rewrite it to.
-        bool found = false;
-        for (const IncludePath &root : include_paths) {
-          if (!root.system) {
-            fs::path rel = fs::relative(local, root.path);
-            std::string relpath = rel.string();
-            if (rel != local &&
-                (relpath.size() < 3 || relpath.substr(0, 2) != "..")) {
-              candidates.push_back({root, relpath, 0, 0});
-              found = true;
-            }
-          }
-        }
-        if (!found) {
-          // Not preferred, but still the only match available.
-          candidates.push_back({IncludePath{dir, false}, include.path, 0, 0});
-        }
-      } else {
-        candidates.push_back({IncludePath{dir, false}, include.path, 0, 0});
-      }
-    }
+  for (const FileReport &report : merged->files) {
+    report_writer->file(report_out, report);
   }
 
-  fs::path incpath_text(include.path);
-
-  /* Try to find a header that is within the same implied folder or subfolder
-   * thereof from the given file we are processing. */
-  for (auto &e : headers) {
-    const IncludePath &incpath = e.first;
-    const auto &hdrs = e.second;
-    for (const fs::path &hdr : hdrs) {
-      if (hdr.filename() == incpath_text.filename()) {
-        Candidate cand{incpath, fs::relative(hdr, incpath.path).string(), 0};
-        cand.folder_distance = calculate_path_distance(
-            file, include, cand.header, cand.search_path);
-        candidates.push_back(cand);
-      } else if (fuzzy > 0) {
-        IncludeStmt closest_path;
-        int closest_distance = fuzzy + 1;
-        std::string key = hdr.filename().string();
-        int dist1 = levenshtein_distance(key, incpath_text.filename().string());
-        int dist2 = levenshtein_distance(key, incpath_text.string());
-        int dist = std::min(dist1, dist2);
-        if (dist <= fuzzy) {
-          Candidate cand{incpath, fs::relative(hdr, incpath.path).string(),
-                         dist};
-          cand.folder_distance = calculate_path_distance(
-              file, include, cand.header, cand.search_path);
-          candidates.push_back(cand);
-        }
-      }
-    }
+  WriteBack write_back;
+  bool committed =
+      dry_run || (stage_shard_edits(*merged, write_back, jobs, console_out) &&
+                  commit(write_back, journal_dir, jobs));
+  console_out << std::endl;
+  console_out << "[Summary]" << std::endl;
+  print_results(merged->summary);
+  end_report(merged->summary);
+  console_out << std::endl;
+  if (!committed) {
+    return 1;
+  } else if (dry_run) {
+    console_out << YELLOW
+                << "Dry run. (Use --merge with --no-dry-run to effectively "
+                   "write changes back to filesystem.)"
+                << CLEAR << std::endl;
   }
+  return 0;
+}
 
-  /* Sort them on distance. */
-  std::sort(candidates.begin(), candidates.end(),
-            [](const Candidate &a, const Candidate &b) {
-              return a.weighted_distance() < b.weighted_distance();
-            });
-
-  return candidates;
+void print_results(const ProcessResult &result) {
+  console_out << "Replaced path: " << result.replaced_path << " / "
+              << result.total << std::endl;
+  console_out << "Sys-to-user  : " << result.system_to_user << " / "
+              << result.total << std::endl;
+  console_out << "User-to-sys  : " << result.user_to_system << " / "
+              << result.total << std::endl;
+  console_out << "Untouched    : " << result.untouched << " / " << result.total
+              << std::endl;
+  console_out << "Failed       : " << result.failed << " / " << result.total
+              << std::endl;
+  console_out << CLEAR;
 }
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <string_view>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define SFINCLUDES_HAVE_MMAP 1
+#endif
+
+/* Read-only view on the contents of a file. Memory-mapped where available,
+ * such that scanning a file does not copy it. */
+class MappedFile {
+public:
+  explicit MappedFile(const std::filesystem::path &path) {
+#ifdef SFINCLUDES_HAVE_MMAP
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return;
+    }
+    struct stat st;
+    if (::fstat(fd, &st) == 0) {
+      good_ = true;
+      if (st.st_size > 0) {
+        void *data =
+            ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+          data_ = static_cast<const char *>(data);
+          size_ = st.st_size;
+        } else {
+          good_ = false;
+        }
+      }
+    }
+    ::close(fd);
+#else
+    std::ifstream in(path, std::ios::binary);
+    if (in) {
+      std::stringstream ss;
+      ss << in.rdbuf();
+      contents_ = ss.str();
+      data_ = contents_.data();
+      size_ = contents_.size();
+      good_ = true;
+    }
+#endif
+  }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  ~MappedFile() { close(); }
+
+  void close() {
+#ifdef SFINCLUDES_HAVE_MMAP
+    if (data_ != nullptr) {
+      ::munmap(const_cast<char *>(data_), size_);
+    }
+#else
+    contents_.clear();
+#endif
+    data_ = nullptr;
+    size_ = 0;
+  }
+
+  bool good() const { return good_; }
+  std::string_view view() const { return {data_, size_}; }
+
+private:
+  const char *data_{nullptr};
+  size_t size_{0};
+  bool good_{false};
+#ifndef SFINCLUDES_HAVE_MMAP
+  std::string contents_;
+#endif
+};
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <fstream>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "sfincludes.hpp"
+
+/* Headers known to have moved, by their old path. An include that named an
+ * old path is rewritten to the new one directly, without searching the
+ * index. Paths are absolute and lexically normal; relative ones are taken
+ * relative to base. Lookups are read-only and can be done from multiple
+ * threads. */
+class MoveMap {
+public:
+  explicit MoveMap(fs::path base = fs::current_path())
+      : base_(std::move(base)) {}
+
+  void add(const fs::path &from, const fs::path &to) {
+    moves_[absolute(from).string()] = absolute(to);
+  }
+
+  size_t size() const { return moves_.size(); }
+
+  /* Where the header an include refers to has moved, if it did, as a
+   * candidate relative to the directory of the including file or to one of
+   * include_paths. The include is looked up as the preprocessor would: next
+   * to the including file for a "" include, then in the include paths. The
+   * new path is written relative to the directory of the including file
+   * when the old one was and it still can be, or else relative to the first
+   * include path containing it. */
+  std::optional<Candidate>
+  find(const IncludeStmt &include, const fs::path &dir,
+       const std::vector<IncludePath> &include_paths) const {
+    const fs::path *to = nullptr;
+    bool local = false;
+    if (!include.system) {
+      to = lookup(dir / include.path);
+      local = to != nullptr;
+    }
+    for (size_t i = 0; !to && i < include_paths.size(); ++i) {
+      to = lookup(include_paths[i].path / include.path);
+    }
+    if (!to) {
+      return std::nullopt;
+    }
+    if (local) {
+      if (std::optional<std::string> header = under(*to, dir)) {
+        return Candidate{IncludePath{dir, false}, *header};
+      }
+    }
+    for (const IncludePath &inc : include_paths) {
+      if (std::optional<std::string> header = under(*to, inc.path)) {
+        return Candidate{inc, *header};
+      }
+    }
+    return Candidate{IncludePath{dir, false},
+                     to->lexically_relative(absolute(dir)).generic_string()};
+  }
+
+private:
+  fs::path absolute(const fs::path &path) const {
+    return (path.is_absolute() ? path : base_ / path).lexically_normal();
+  }
+
+  const fs::path *lookup(const fs::path &path) const {
+    auto it = moves_.find(absolute(path).string());
+    return it != moves_.end() ? &it->second : nullptr;
+  }
+
+  /* The path of file relative to dir, if it is in dir or below. */
+  std::optional<std::string> under(const fs::path &file,
+                                   const fs::path &dir) const {
+    fs::path relative = file.lexically_relative(absolute(dir));
+    if (relative.empty() || *relative.begin() == "..") {
+      return std::nullopt;
+    }
+    return relative.generic_string();
+  }
+
+  fs::path base_;
+  std::unordered_map<std::string, fs::path> moves_;
+};
+
+/* Reads a move map, with paths relative to the working directory:
+ *
+ *  - JSON: an object of old to new paths, or an array of [old, new] pairs
+ *    or of {"old": ..., "new": ...} objects;
+ *  - otherwise lines of old and new path, separated by a tab, which may also
+ *    be the output of git diff --name-status -M: its rename (R) lines are
+ *    used, other changes are skipped. Empty lines and lines starting with
+ *    '#' are skipped.
+ *
+ * Throws std::runtime_error on a malformed file. */
+inline MoveMap load_move_map(const fs::path &path) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    throw std::runtime_error("cannot open " + path.string());
+  }
+  MoveMap map;
+  in >> std::ws;
+  int first = in.peek();
+  if (first == '{' || first == '[') {
+    namespace pt = boost::property_tree;
+    pt::ptree json;
+    pt::read_json(in, json);
+    for (const auto &[key, value] : json) {
+      if (!key.empty()) {
+        map.add(key, value.get_value<std::string>());
+      } else if (value.count("old")) {
+        map.add(value.get<std::string>("old"), value.get<std::string>("new"));
+      } else if (value.size() == 2) {
+        auto it = value.begin();
+        std::string from = (it++)->second.get_value<std::string>();
+        map.add(from, it->second.get_value<std::string>());
+      } else {
+        throw std::runtime_error("expected an [old, new] pair in " +
+                                 path.string());
+      }
+    }
+    return map;
+  }
+
+  std::string line;
+  for (size_t number = 1; std::getline(in, line); ++number) {
+    if (!line.empty() && line.back() == '\r') {
+      line.pop_back();
+    }
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    std::vector<std::string_view> fields;
+    std::string_view rest = line;
+    for (size_t tab; (tab = rest.find('\t')) != std::string_view::npos;) {
+      fields.push_back(rest.substr(0, tab));
+      rest.remove_prefix(tab + 1);
+    }
+    fields.push_back(rest);
+    /* git status letters, optionally followed by a similarity score. */
+    bool git_status = fields[0].find_first_not_of("ACDMRTUX0123456789") ==
+                          std::string_view::npos &&
+                      fields.size() >= 2 && fields[0].size() <= 4;
+    if (git_status && fields.size() == 3 && fields[0][0] == 'R') {
+      map.add(fields[1], fields[2]);
+    } else if (git_status) {
+      continue;
+    } else if (fields.size() == 2) {
+      map.add(fields[0], fields[1]);
+    } else {
+      throw std::runtime_error(path.string() + ":" + std::to_string(number) +
+                               ": expected old and new path separated by a "
+                               "tab");
+    }
+  }
+  return map;
+}
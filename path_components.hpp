@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "sfincludes.hpp"
+#include "string_pool.hpp"
+
+/* Absolute, normalized path as a sequence of interned component ids. The root
+ * directory is not stored. */
+using ComponentPath = std::vector<uint32_t>;
+
+/* Interns path components, such that paths which were canonicalized once can
+ * be compared and made relative to each other without touching the
+ * filesystem. Components are only added while indexing; lookups are
+ * read-only and can be done from multiple threads. */
+class ComponentTable {
+public:
+  static constexpr uint32_t UNKNOWN = UINT32_MAX;
+
+  /* Splits an absolute, normalized path, interning its components. */
+  ComponentPath intern(const fs::path &path) {
+    ComponentPath result;
+    for (const fs::path &component : path.relative_path()) {
+      result.push_back(names_.intern(component.native()));
+    }
+    return result;
+  }
+
+  /* Splits an absolute, normalized path. Components that were never interned
+   * become UNKNOWN, which does not compare equal to any interned path. */
+  ComponentPath lookup(const fs::path &path) const {
+    ComponentPath result;
+    for (const fs::path &component : path.relative_path()) {
+      uint32_t id = names_.find(component.native());
+      result.push_back(id != StringPool::NOT_FOUND ? id : UNKNOWN);
+    }
+    return result;
+  }
+
+  uint32_t intern_name(std::string_view name) { return names_.intern(name); }
+  std::string_view name(uint32_t id) const { return names_[id]; }
+
+  /* Same as fs::path::lexically_relative(target, base).string(), for the
+   * canonical paths both sides were made from. The target is the directory
+   * target_dir with the component target_name appended. */
+  std::string relative(const ComponentPath &target_dir, uint32_t target_name,
+                       const ComponentPath &base) const {
+    size_t target_size = target_dir.size() + 1;
+    auto target = [&](size_t i) {
+      return i < target_dir.size() ? target_dir[i] : target_name;
+    };
+    size_t common = 0;
+    while (common < target_size && common < base.size() &&
+           target(common) == base[common] && target(common) != UNKNOWN) {
+      common++;
+    }
+    if (common == target_size && common == base.size()) {
+      return ".";
+    }
+    std::string result;
+    for (size_t i = common; i < base.size(); ++i) {
+      if (!result.empty()) {
+        result += '/';
+      }
+      result += "..";
+    }
+    for (size_t i = common; i < target_size; ++i) {
+      if (!result.empty()) {
+        result += '/';
+      }
+      result += names_[target(i)];
+    }
+    if (result.empty()) {
+      return ".";
+    }
+    return result;
+  }
+
+  size_t memory_usage() const { return names_.memory_usage(); }
+
+private:
+  StringPool names_;
+};
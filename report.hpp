@@ -0,0 +1,364 @@
+#pragma once
+
+#include <cctype>
+#include <memory>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "include_scanner.hpp"
+#include "sfincludes.hpp"
+
+const std::string RED = "\033[31m";
+const std::string GREEN = "\033[32m";
+const std::string YELLOW = "\033[33m";
+const std::string BLUE = "\033[34m";
+const std::string DIM = "\033[2m";
+const std::string CLEAR = "\033[0m";
+
+enum class IncludeAction { ReplacePath, ChangeType, Untouched, Failed };
+
+/* What happened to one #include line. */
+struct IncludeReport {
+  size_t line{0}; // 1-based
+  IncludeAction action{IncludeAction::Failed};
+  std::string old_include{}; // as written, with its quotes or angle brackets
+  std::string new_include{}; // empty when it failed
+  CandidateList candidates{}; // the fix first, then the alternatives
+};
+
+/* A header an include resolved to. */
+struct ReachedHeader {
+  fs::path path;
+  bool system{false}; // found in a system include path
+};
+
+struct FileReport {
+  fs::path file;
+  bool unreadable{false};
+  std::vector<IncludeReport> includes;
+  // The headers the includes resolve to. Only for a SourceTask with its own
+  // include paths, or with Options::record_includes.
+  std::vector<ReachedHeader> reached;
+  // What was counted for this file.
+  ProcessResult result{};
+  // With Options::record_edits: the changes to the file, if any, and the
+  // fnv1a_hash() of the contents they apply to.
+  std::vector<TextEdit> edits{};
+  uint64_t content_hash{0};
+};
+
+enum class ReportFormat { Text, JsonLines, Sarif };
+
+inline std::optional<ReportFormat> parse_report_format(std::string_view name) {
+  if (name == "text") {
+    return ReportFormat::Text;
+  } else if (name == "jsonl") {
+    return ReportFormat::JsonLines;
+  } else if (name == "sarif") {
+    return ReportFormat::Sarif;
+  }
+  return std::nullopt;
+}
+
+/* Formats the report. All calls are made from one thread, in report order. */
+class ReportWriter {
+public:
+  virtual ~ReportWriter() = default;
+  virtual void begin(std::ostream &/*out*/) {}
+  virtual void rename(std::ostream &out, const fs::path &from,
+                      const fs::path &to) = 0;
+  virtual void file(std::ostream &out, const FileReport &report) = 0;
+  virtual void end(std::ostream &/*out*/, const ProcessResult &/*summary*/) {}
+};
+
+/* The human readable, colored format. */
+class TextReportWriter : public ReportWriter {
+public:
+  void rename(std::ostream &out, const fs::path &from,
+              const fs::path &to) override {
+    out << GREEN << "🏷\ufe0f Rename: " << from << "  ->  " << to << CLEAR
+        << '\n';
+  }
+
+  void file(std::ostream &out, const FileReport &report) override {
+    out << "    Process " << report.file.string() << " ..." << '\n';
+    if (report.unreadable) {
+      out << RED << "        Could not read file." << CLEAR << '\n';
+    }
+    for (const IncludeReport &inc : report.includes) {
+      switch (inc.action) {
+      case IncludeAction::ReplacePath: {
+        const Candidate &fix = (*inc.candidates)[0];
+        out << YELLOW << "        👕 Replace include path: " << inc.old_include;
+        out << "  ->  " << inc.new_include;
+        out << DIM << "  (distance: fn=" << fix.filename_distance
+            << "; dir=" << fix.folder_distance << ") from "
+            << fix.search_path.path << CLEAR << '\n';
+        break;
+      }
+      case IncludeAction::ChangeType:
+        out << BLUE << "        💄 Change include type: " << inc.old_include;
+        out << "  ->  " << inc.new_include << CLEAR << '\n';
+        break;
+      case IncludeAction::Untouched:
+        out << GREEN << "        ✅ Untouched include: " << inc.old_include
+            << CLEAR << '\n';
+        break;
+      case IncludeAction::Failed:
+        out << RED << "        ❓ Failed to fix include: " << inc.old_include
+            << CLEAR << '\n';
+        continue;
+      }
+
+      for (size_t i = 1; i < inc.candidates->size(); ++i) {
+        const Candidate &alt = (*inc.candidates)[i];
+        out << DIM << "           - Alternative: " << alt.header;
+        out << DIM << "  (distance: fn=" << alt.filename_distance
+            << "; dir=" << alt.folder_distance << ") from "
+            << alt.search_path.path << CLEAR << '\n';
+      }
+    }
+  }
+};
+
+inline void write_json_string(std::ostream &out, std::string_view s) {
+  const char *hex = "0123456789abcdef";
+  out << '"';
+  for (char c : s) {
+    switch (c) {
+    case '"':
+      out << "\\\"";
+      break;
+    case '\\':
+      out << "\\\\";
+      break;
+    case '\n':
+      out << "\\n";
+      break;
+    case '\t':
+      out << "\\t";
+      break;
+    default:
+      if (static_cast<unsigned char>(c) < 0x20) {
+        out << "\\u00" << hex[(c >> 4) & 0xf] << hex[c & 0xf];
+      } else {
+        out << c;
+      }
+    }
+  }
+  out << '"';
+}
+
+inline const char *action_name(IncludeAction action) {
+  const char *names[] = {"replace_path", "change_type", "untouched", "failed"};
+  return names[int(action)];
+}
+
+inline void write_json_candidate(std::ostream &out, const Candidate &c) {
+  out << "{\"header\": ";
+  write_json_string(out, c.header);
+  out << ", \"filename_distance\": " << c.filename_distance
+      << ", \"folder_distance\": " << c.folder_distance
+      << ", \"search_root\": ";
+  write_json_string(out, c.search_path.path.string());
+  out << ", \"system\": " << (c.search_path.system ? "true" : "false") << "}";
+}
+
+/* "old", "new", "fix" and "alternatives" of an include, shared by the JSON
+ * Lines and SARIF formats. */
+inline void write_json_include_fields(std::ostream &out,
+                                      const IncludeReport &inc) {
+  out << "\"action\": \"" << action_name(inc.action) << "\", \"old\": ";
+  write_json_string(out, inc.old_include);
+  out << ", \"new\": ";
+  if (inc.action == IncludeAction::Failed) {
+    out << "null, \"fix\": null, \"alternatives\": []";
+    return;
+  }
+  write_json_string(out, inc.new_include);
+  out << ", \"fix\": ";
+  write_json_candidate(out, (*inc.candidates)[0]);
+  out << ", \"alternatives\": [";
+  for (size_t i = 1; i < inc.candidates->size(); ++i) {
+    out << (i > 1 ? ", " : "");
+    write_json_candidate(out, (*inc.candidates)[i]);
+  }
+  out << "]";
+}
+
+inline void write_json_summary(std::ostream &out, const ProcessResult &r) {
+  out << "{\"total\": " << r.total << ", \"replaced_path\": " << r.replaced_path
+      << ", \"system_to_user\": " << r.system_to_user
+      << ", \"user_to_system\": " << r.user_to_system
+      << ", \"untouched\": " << r.untouched << ", \"failed\": " << r.failed
+      << "}";
+}
+
+/* One JSON object per line, discriminated by "type". */
+class JsonLinesReportWriter : public ReportWriter {
+public:
+  void rename(std::ostream &out, const fs::path &from,
+              const fs::path &to) override {
+    out << "{\"type\": \"rename\", \"old\": ";
+    write_json_string(out, from.string());
+    out << ", \"new\": ";
+    write_json_string(out, to.string());
+    out << "}\n";
+  }
+
+  void file(std::ostream &out, const FileReport &report) override {
+    if (report.unreadable) {
+      out << "{\"type\": \"unreadable\", \"file\": ";
+      write_json_string(out, report.file.string());
+      out << "}\n";
+    }
+    for (const IncludeReport &inc : report.includes) {
+      out << "{\"type\": \"include\", \"file\": ";
+      write_json_string(out, report.file.string());
+      out << ", \"line\": " << inc.line << ", ";
+      write_json_include_fields(out, inc);
+      out << "}\n";
+    }
+  }
+
+  void end(std::ostream &out, const ProcessResult &summary) override {
+    out << "{\"type\": \"summary\", \"result\": ";
+    write_json_summary(out, summary);
+    out << "}\n";
+  }
+};
+
+/* A SARIF 2.1.0 log with a single run. Every include is a result, with the
+ * same fields as in the JSON Lines format under "properties". */
+class SarifReportWriter : public ReportWriter {
+public:
+  void begin(std::ostream &out) override {
+    out << "{\"version\": \"2.1.0\",\n"
+           " \"$schema\": \"https://json.schemastore.org/sarif-2.1.0.json\",\n"
+           " \"runs\": [{\n"
+           "  \"tool\": {\"driver\": {\"name\": \"sfincludes\", \"rules\": [\n"
+           "   {\"id\": \"replace_path\", \"shortDescription\": {\"text\": "
+           "\"Include path does not match the header location.\"}},\n"
+           "   {\"id\": \"change_type\", \"shortDescription\": {\"text\": "
+           "\"Include type does not match the search path of the header.\"}},\n"
+           "   {\"id\": \"untouched\", \"shortDescription\": {\"text\": "
+           "\"Include is correct.\"}},\n"
+           "   {\"id\": \"failed\", \"shortDescription\": {\"text\": "
+           "\"No header found for the include.\"}},\n"
+           "   {\"id\": \"rename\", \"shortDescription\": {\"text\": "
+           "\"Header is renamed.\"}},\n"
+           "   {\"id\": \"unreadable\", \"shortDescription\": {\"text\": "
+           "\"Source file could not be read.\"}}]}},\n"
+           "  \"results\": [";
+  }
+
+  void rename(std::ostream &out, const fs::path &from,
+              const fs::path &to) override {
+    begin_result(out, "rename", "warning",
+                 "Rename " + from.string() + " to " + to.string(), from, 0);
+    out << ", \"properties\": {\"old\": ";
+    write_json_string(out, from.string());
+    out << ", \"new\": ";
+    write_json_string(out, to.string());
+    out << "}}";
+  }
+
+  void file(std::ostream &out, const FileReport &report) override {
+    if (report.unreadable) {
+      begin_result(out, "unreadable", "error", "Could not read file.",
+                   report.file, 0);
+      out << "}";
+    }
+    for (const IncludeReport &inc : report.includes) {
+      std::string message;
+      const char *level = "warning";
+      switch (inc.action) {
+      case IncludeAction::ReplacePath:
+        message = "Replace include path: ";
+        break;
+      case IncludeAction::ChangeType:
+        message = "Change include type: ";
+        break;
+      case IncludeAction::Untouched:
+        message = "Untouched include: ";
+        level = "none";
+        break;
+      case IncludeAction::Failed:
+        message = "Failed to fix include: ";
+        level = "error";
+        break;
+      }
+      message += inc.old_include;
+      if (inc.action != IncludeAction::Failed &&
+          inc.action != IncludeAction::Untouched) {
+        message += " -> " + inc.new_include;
+      }
+      begin_result(out, action_name(inc.action), level, message, report.file,
+                   inc.line);
+      out << ", \"properties\": {";
+      write_json_include_fields(out, inc);
+      out << "}}";
+    }
+  }
+
+  void end(std::ostream &out, const ProcessResult &summary) override {
+    out << "],\n  \"properties\": {\"summary\": ";
+    write_json_summary(out, summary);
+    out << "}}]}\n";
+  }
+
+private:
+  void begin_result(std::ostream &out, const char *rule, const char *level,
+                    const std::string &message, const fs::path &file,
+                    size_t line) {
+    out << (first_result_ ? "\n   " : ",\n   ");
+    first_result_ = false;
+    out << "{\"ruleId\": \"" << rule << "\", \"level\": \"" << level
+        << "\", \"message\": {\"text\": ";
+    write_json_string(out, message);
+    out << "}, \"locations\": [{\"physicalLocation\": {\"artifactLocation\": "
+           "{\"uri\": ";
+    write_json_string(out, uri(file));
+    out << "}";
+    if (line > 0) {
+      out << ", \"region\": {\"startLine\": " << line << "}";
+    }
+    out << "}}]";
+  }
+
+  /* Relative paths are relative URI references; absolute ones become file
+   * URIs. */
+  static std::string uri(const fs::path &file) {
+    const char *hex = "0123456789ABCDEF";
+    std::string path = file.generic_string();
+    std::string uri = file.is_absolute() ? "file://" : "";
+    for (char c : path) {
+      unsigned char u = static_cast<unsigned char>(c);
+      if (std::isalnum(u) ||
+          std::string_view("/-._~").find(c) != std::string_view::npos) {
+        uri += c;
+      } else {
+        uri += '%';
+        uri += hex[u >> 4];
+        uri += hex[u & 0xf];
+      }
+    }
+    return uri;
+  }
+
+  bool first_result_{true};
+};
+
+inline std::unique_ptr<ReportWriter> make_report_writer(ReportFormat format) {
+  switch (format) {
+  case ReportFormat::JsonLines:
+    return std::make_unique<JsonLinesReportWriter>();
+  case ReportFormat::Sarif:
+    return std::make_unique<SarifReportWriter>();
+  default:
+    return std::make_unique<TextReportWriter>();
+  }
+}
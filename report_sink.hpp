@@ -0,0 +1,121 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* Writes chunks of text to a FILE on a background thread, such that the
+ * threads producing the report never wait for the terminal or the pipe.
+ * Chunks are written in the order they were handed over. */
+class ReportSink {
+public:
+  explicit ReportSink(std::FILE *file) : file_(file) {
+    std::setvbuf(file_, nullptr, _IOFBF, 1 << 16);
+    thread_ = std::thread([this]() { run(); });
+  }
+
+  ~ReportSink() { close(); }
+
+  ReportSink(const ReportSink &) = delete;
+  ReportSink &operator=(const ReportSink &) = delete;
+
+  void write(std::string chunk) {
+    if (chunk.empty()) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue_.push_back(std::move(chunk));
+    ready_.notify_one();
+  }
+
+  /* Writes out everything handed over so far, and stops the writer thread. */
+  void close() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      closing_ = true;
+      ready_.notify_one();
+    }
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+  }
+
+private:
+  void run() {
+    std::vector<std::string> batch;
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        ready_.wait(lock, [&]() { return !queue_.empty() || closing_; });
+        if (queue_.empty()) {
+          break;
+        }
+        batch.swap(queue_);
+      }
+      for (const std::string &chunk : batch) {
+        std::fwrite(chunk.data(), 1, chunk.size(), file_);
+      }
+      batch.clear();
+      /* Flush once the producers are idle, so that progress still shows. */
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (queue_.empty()) {
+        std::fflush(file_);
+      }
+    }
+    std::fflush(file_);
+  }
+
+  std::FILE *file_;
+  std::mutex mutex_;
+  std::condition_variable ready_;
+  std::vector<std::string> queue_;
+  bool closing_{false};
+  std::thread thread_;
+};
+
+/* Stream buffer collecting text for a ReportSink. The text is handed over
+ * when the stream is flushed (std::endl, std::flush) or when the buffer is
+ * full: write '\n' rather than std::endl to batch many lines. */
+class SinkStreamBuf : public std::streambuf {
+public:
+  explicit SinkStreamBuf(ReportSink &sink) : sink_(sink) {}
+
+  ~SinkStreamBuf() { sync(); }
+
+protected:
+  int_type overflow(int_type ch) override {
+    if (ch != traits_type::eof()) {
+      buffer_.push_back(traits_type::to_char_type(ch));
+      hand_over_if_full();
+    }
+    return traits_type::not_eof(ch);
+  }
+
+  std::streamsize xsputn(const char *s, std::streamsize n) override {
+    buffer_.append(s, n);
+    hand_over_if_full();
+    return n;
+  }
+
+  int sync() override {
+    sink_.write(std::move(buffer_));
+    buffer_.clear();
+    return 0;
+  }
+
+private:
+  static constexpr size_t CHUNK_SIZE = 1 << 16;
+
+  void hand_over_if_full() {
+    if (buffer_.size() >= CHUNK_SIZE) {
+      sync();
+    }
+  }
+
+  ReportSink &sink_;
+  std::string buffer_;
+};
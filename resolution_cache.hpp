@@ -0,0 +1,62 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+/* Thread-safe memo table from a string key to an immutable value. The table
+ * is split into shards with their own lock, so that worker threads resolving
+ * different includes rarely wait on each other. The value is computed outside
+ * of the lock: two threads missing on the same key at the same time both
+ * compute it, and the first one to finish wins. */
+template <typename Value> class MemoCache {
+public:
+  using Ptr = std::shared_ptr<const Value>;
+
+  template <typename Compute>
+  Ptr get_or_compute(const std::string &key, Compute &&compute) {
+    Shard &shard = shards_[std::hash<std::string>{}(key) % NUM_SHARDS];
+    {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      auto it = shard.map.find(key);
+      if (it != shard.map.end()) {
+        hits_++;
+        return it->second;
+      }
+    }
+    Ptr value = std::make_shared<const Value>(compute());
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto [it, inserted] = shard.map.emplace(key, std::move(value));
+    // Count per key, such that the numbers do not depend on thread timing.
+    if (inserted) {
+      misses_++;
+    } else {
+      hits_++;
+    }
+    return it->second;
+  }
+
+  /* Forgets all values. Not to be called concurrently with
+   * get_or_compute(). */
+  void clear() {
+    for (Shard &shard : shards_) {
+      shard.map.clear();
+    }
+  }
+
+  size_t hits() const { return hits_; }
+  size_t misses() const { return misses_; }
+
+private:
+  static constexpr size_t NUM_SHARDS = 64;
+  struct Shard {
+    std::mutex mutex;
+    std::unordered_map<std::string, Ptr> map;
+  };
+  Shard shards_[NUM_SHARDS];
+  std::atomic<size_t> hits_{0};
+  std::atomic<size_t> misses_{0};
+};
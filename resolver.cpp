@@ -0,0 +1,630 @@
+#include "resolver.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <iterator>
+#include <mutex>
+#include <numeric>
+#include <set>
+#include <thread>
+#include <unordered_map>
+
+#include "include_scanner.hpp"
+#include "levenshtein_distance.hpp"
+#include "mapped_file.hpp"
+#include "shard.hpp"
+#include "traversal.hpp"
+
+void find_headers(const fs::path &dir, std::vector<std::string> &headers,
+                  const Options &options) {
+  walk_tree(dir, options, has_header_extension, [&](const fs::path &file) {
+    headers.push_back(file.string());
+  });
+}
+
+bool has_source_extension(const fs::path &file) {
+  const std::vector<std::string> EXT = {".cpp", ".cxx", ".cc", ".h", ".hpp"};
+  return std::find(EXT.begin(), EXT.end(), file.extension()) != EXT.end();
+}
+
+std::vector<fs::path> find_sources(const fs::path &dir,
+                                   const Options &options) {
+  std::vector<fs::path> files;
+  walk_tree(dir, options, has_source_extension,
+            [&](const fs::path &file) { files.push_back(file); });
+  return files;
+}
+
+std::optional<IncludeLine> parse_include_line(std::string_view line,
+                                              bool process_system_includes) {
+  /* The same blanks as the lexer that found the directive line. */
+  auto skip_blanks = [&](size_t pos) {
+    while (pos < line.size() && lexer::is_blank(line[pos])) {
+      pos++;
+    }
+    return pos;
+  };
+  size_t pos = skip_blanks(1);
+  IncludeLine include;
+  const std::string_view directive = "include";
+  if (line.compare(pos, directive.size(), directive) != 0) {
+    return std::nullopt;
+  }
+  pos += directive.size();
+  const std::string_view next = "_next";
+  if (line.compare(pos, next.size(), next) == 0) {
+    include.next = true;
+    pos += next.size();
+  }
+  pos = skip_blanks(pos);
+  if (pos == line.size() || (line[pos] != '"' && line[pos] != '<')) {
+    return std::nullopt;
+  }
+  include.system = line[pos] == '<';
+  if (include.system && !process_system_includes) {
+    return std::nullopt;
+  }
+
+  size_t end = line.find(include.system ? '>' : '"', pos + 1);
+  if (end == std::string_view::npos) {
+    return std::nullopt;
+  }
+  include.path = line.substr(pos + 1, end - pos - 1);
+  include.path_with_quotes = line.substr(pos, end - pos + 1);
+  include.behind_path = line.substr(end + 1);
+  return include;
+}
+
+std::vector<IncludeStmt> scan_includes(const fs::path &file,
+                                       const Options &options) {
+  std::vector<IncludeStmt> includes;
+  MappedFile in(file);
+  for_each_directive_line(in.view(), [&](size_t, std::string_view line) {
+    if (auto include =
+            parse_include_line(line, options.process_system_includes)) {
+      includes.push_back({std::string(include->path), include->system});
+    }
+  });
+  return includes;
+}
+
+Resolver::Resolver(const Options &options,
+                   std::vector<IncludePath> include_paths, HeaderMap headers,
+                   const Vfs &vfs)
+    : options_(options), include_paths_(std::move(include_paths)),
+      vfs_(&vfs) {
+  index_.build(headers, vfs);
+  if (options_.fuzzy > 0) {
+    index_.build_fuzzy();
+  }
+}
+
+ProcessResult Resolver::process_sources(
+    std::vector<fs::path> sources,
+    const std::function<void(const FileReport &)> &on_report) const {
+  std::vector<SourceTask> tasks;
+  for (fs::path &file : sources) {
+    if (in_shard(file, options_)) {
+      tasks.push_back({std::move(file)});
+    }
+  }
+  return process_files(tasks, on_report);
+}
+
+ProcessResult Resolver::process_dir(
+    const fs::path &dir,
+    const std::function<void(const FileReport &)> &on_report) const {
+  std::optional<PhaseTimer> phase(Phase::Traversal);
+  std::vector<fs::path> sources = find_sources(dir, options_);
+  phase.reset();
+  return process_sources(std::move(sources), on_report);
+}
+
+ProcessResult Resolver::process_reachable(
+    const std::vector<SourceTask> &tasks,
+    const std::function<void(const FileReport &)> &on_report) const {
+  ProcessResult result{};
+  std::set<std::string> seen;
+  std::vector<SourceTask> level;
+  for (const SourceTask &task : tasks) {
+    if (in_shard(task.file, options_) &&
+        seen.insert(task.file.lexically_normal().string()).second) {
+      level.push_back(task);
+    }
+  }
+  /* Breadth first: the headers reached by one level of files are only known
+   * once all of them are processed. */
+  while (!level.empty()) {
+    std::vector<SourceTask> next;
+    size_t i = 0;
+    accumulate(&result, process_files(level, [&](const FileReport &report) {
+                 for (const ReachedHeader &header : report.reached) {
+                   if (!header.system &&
+                       seen.insert(header.path.string()).second) {
+                     next.push_back({header.path, level[i].include_paths});
+                   }
+                 }
+                 i++;
+                 on_report(report);
+               }));
+    level = std::move(next);
+  }
+  return result;
+}
+
+ProcessResult Resolver::process_files(
+    const std::vector<SourceTask> &tasks,
+    const std::function<void(const FileReport &)> &on_report) const {
+  ProcessResult result{};
+  if (options_.jobs <= 1 || tasks.size() <= 1) {
+    for (const SourceTask &task : tasks) {
+      FileReport report;
+      process_file(task, &result, &report);
+      on_report(report);
+    }
+    return result;
+  }
+
+  /* Workers grab the next unprocessed file from a shared counter, so that a
+   * few large files do not hold up an otherwise idle thread. Every file gets
+   * its own report, which is handed over in order as soon as it and all
+   * files before it are done. */
+  int num_threads = std::min<size_t>(options_.jobs, tasks.size());
+  std::vector<ProcessResult> thread_results(num_threads);
+  std::vector<FileReport> reports(tasks.size());
+  std::vector<bool> done(tasks.size(), false);
+  std::mutex mutex;
+  std::condition_variable report_ready;
+  std::atomic<size_t> next_file{0};
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < num_threads; ++t) {
+    threads.emplace_back([&, t]() {
+      size_t i;
+      while ((i = next_file++) < tasks.size()) {
+        process_file(tasks[i], &thread_results[t], &reports[i]);
+        std::lock_guard<std::mutex> lock(mutex);
+        done[i] = true;
+        report_ready.notify_one();
+      }
+      flush_thread_stats();
+    });
+  }
+
+  for (size_t i = 0; i < tasks.size(); ++i) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      report_ready.wait(lock, [&]() { return done[i]; });
+    }
+    on_report(reports[i]);
+    reports[i] = FileReport{};
+  }
+
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  for (const ProcessResult &r : thread_results) {
+    accumulate(&result, r);
+  }
+  return result;
+}
+
+void Resolver::process_file(const SourceTask &task, ProcessResult *result,
+                            FileReport *report) const {
+  PhaseTimer phase(Phase::Scan);
+  const fs::path &file = task.file;
+  report->file = file;
+  SourceFile source{file, *vfs_};
+  MappedFile in(file);
+  if (!in.good()) {
+    report->unreadable = true;
+    return;
+  }
+  count(Stat::FilesScanned);
+  count(Stat::BytesRead, in.view().size());
+
+  /* Only the includes that actually change are recorded, as edits to the
+   * mapped file. */
+  std::vector<TextEdit> edits;
+  std::string_view text = in.view();
+  size_t line_number = 1, counted_up_to = 0;
+  for_each_directive_line(text, [&](size_t offset, std::string_view line) {
+    std::optional<IncludeLine> parsed =
+        parse_include_line(line, options_.process_system_includes);
+    if (!parsed) {
+      return;
+    }
+    count(Stat::Includes);
+    bool system = parsed->system;
+
+    IncludeReport include =
+        fix(IncludeStmt{std::string(parsed->path), system}, source,
+            &report->result, task.include_paths.get());
+    include.old_include = parsed->path_with_quotes;
+    if (include.action != IncludeAction::Failed &&
+        (task.include_paths || options_.record_includes)) {
+      const Candidate &fix = (*include.candidates)[0];
+      report->reached.push_back(
+          {(fix.search_path.path / fix.header).lexically_normal(),
+           fix.search_path.system});
+    }
+    /* Only the quoted path is replaced: the spelling of the directive and
+     * what follows it are kept. */
+    if (include.action != IncludeAction::Failed &&
+        include.new_include != parsed->path_with_quotes) {
+      size_t path_offset =
+          offset + (parsed->path_with_quotes.data() - line.data());
+      edits.push_back({path_offset, parsed->path_with_quotes.size(),
+                       include.new_include});
+    }
+
+    if ((include.action == IncludeAction::Untouched &&
+         options_.omit_untouched) ||
+        (include.action == IncludeAction::Failed && system &&
+         options_.omit_system_failed)) {
+      return;
+    }
+    line_number += std::count(text.begin() + counted_up_to,
+                              text.begin() + offset, '\n');
+    counted_up_to = offset;
+    include.line = line_number;
+    report->includes.push_back(std::move(include));
+  });
+  accumulate(result, report->result);
+
+  if (options_.record_edits && !edits.empty()) {
+    report->content_hash = fnv1a_hash(text);
+    report->edits = edits;
+  }
+
+  /* Files without changes are neither copied nor written. */
+  if (!options_.dry_run && !edits.empty()) {
+    PhaseTimer phase(Phase::WriteBack);
+    std::string contents = apply_edits(text, edits);
+    in.close();
+    if (write_back_) {
+      write_back_->write(file, std::move(contents));
+    } else {
+      write_file_atomically(file, contents);
+    }
+  }
+}
+
+void Resolver::add_header(const fs::path &header) {
+  for (uint32_t root = 0; root < index_.roots().size(); ++root) {
+    fs::path relative = header.lexically_relative(index_.roots()[root].path);
+    if (!relative.empty() && *relative.begin() != "..") {
+      index_.add(root, header, *vfs_);
+    }
+  }
+  cache_.matches.clear();
+  cache_.candidates.clear();
+}
+
+std::vector<std::string> Resolver::remove_headers(const fs::path &path) {
+  std::vector<std::string> filenames;
+  for (uint32_t entry : index_.remove(path)) {
+    filenames.emplace_back(index_.filename(index_.filename_id(entry)));
+  }
+  cache_.matches.clear();
+  cache_.candidates.clear();
+  return filenames;
+}
+
+IncludeReport
+Resolver::fix(const IncludeStmt &include, const SourceFile &file,
+              ProcessResult *result,
+              const std::vector<IncludePath> *include_paths) const {
+  (result->total)++;
+  const bool system = include.system;
+  IncludeReport report;
+  report.old_include =
+      system ? "<" + include.path + ">" : "\"" + include.path + "\"";
+  std::optional<Candidate> moved;
+  if (move_map_) {
+    moved = move_map_->find(include, file.path.parent_path(),
+                            include_paths ? *include_paths : include_paths_);
+  }
+  if (moved) {
+    count(Stat::MovedIncludes);
+    report.candidates =
+        std::make_shared<const std::vector<Candidate>>(1, *moved);
+  } else {
+    report.candidates = resolve(include, file, include_paths);
+  }
+  if (include_paths && !moved) {
+    fs::path dir = file.path.parent_path();
+    auto in_scope = [&](const Candidate &c) {
+      if (c.search_path.path == dir) {
+        return true; // Next to the file.
+      }
+      for (const IncludePath &inc : *include_paths) {
+        if (inc.path == c.search_path.path) {
+          return true;
+        }
+      }
+      return false;
+    };
+    if (!std::all_of(report.candidates->begin(), report.candidates->end(),
+                     in_scope)) {
+      /* When all the best candidates are out of scope, the best in scope is
+       * looked for among all candidates. */
+      bool ranked_out = report.candidates->size() == max_candidates() &&
+                        std::none_of(report.candidates->begin(),
+                                     report.candidates->end(), in_scope);
+      auto all = ranked_out ? std::make_shared<const std::vector<Candidate>>(
+                                  find_candidates(include, file, 0,
+                                                  include_paths))
+                            : report.candidates;
+      auto scoped = std::make_shared<std::vector<Candidate>>();
+      std::copy_if(all->begin(), all->end(), std::back_inserter(*scoped),
+                   in_scope);
+      if (scoped->size() > max_candidates() && max_candidates() > 0) {
+        scoped->resize(max_candidates());
+      }
+      report.candidates = std::move(scoped);
+    }
+  }
+  count(Stat::Candidates, report.candidates->size());
+  const std::vector<Candidate> &candidate_fixes = *report.candidates;
+
+  if (candidate_fixes.empty()) {
+    (result->failed)++;
+    report.action = IncludeAction::Failed;
+    return report;
+  }
+
+  const Candidate &fix = candidate_fixes[0];
+  bool emit_system_include = false;
+  if ((system && fix.search_path.system) || // already good
+      (!system && fix.search_path.system &&
+       options_.user_to_system) || // changed to system
+      (system && !fix.search_path.system &&
+       !options_.user_to_system)) { // can't touch
+    emit_system_include = true;
+  }
+
+  if (emit_system_include) {
+    report.new_include = "<" + fix.header + ">";
+  } else {
+    report.new_include = "\"" + fix.header + "\"";
+  }
+
+  bool changed_include_type = system != emit_system_include;
+  if (changed_include_type) {
+    if (system) {
+      result->system_to_user++;
+    } else {
+      result->user_to_system++;
+    }
+  }
+
+  if (fix.header != include.path) {
+    (result->replaced_path)++;
+    report.action = IncludeAction::ReplacePath;
+  } else if (changed_include_type) {
+    report.action = IncludeAction::ChangeType;
+  } else {
+    (result->untouched)++;
+    report.action = IncludeAction::Untouched;
+  }
+  return report;
+}
+
+/* fix_include() only depends on the directory of the file: the local include
+ * check is relative to that directory, and the path distance is relative to
+ * the file, which lexically is the directory plus one "..". The latter does
+ * not hold for symlinked files, which therefore bypass the cache. With
+ * --prefer-relative-to-root, a local include also depends on the user
+ * include paths it may be rewritten to, which are then part of the key. The
+ * index lookup only depends on the include text, and is shared by all
+ * directories. */
+CandidateList
+Resolver::resolve(const IncludeStmt &include, const SourceFile &file,
+                  const std::vector<IncludePath> *include_paths) const {
+  PhaseTimer phase(Phase::Resolve);
+  auto resolve = [&]() {
+    return find_candidates(include, file, max_candidates(), include_paths);
+  };
+  if (file.is_symlink) {
+    return std::make_shared<const std::vector<Candidate>>(resolve());
+  }
+  std::string key = (include.system ? "<" : "\"") + include.path + '\0' +
+                    file.path.parent_path().string();
+  if (include_paths && options_.prefer_relative_to_root && !include.system) {
+    uint64_t roots = 0;
+    for (const IncludePath &inc : *include_paths) {
+      if (!inc.system) {
+        roots = fnv1a_hash(inc.path.native()) ^ (roots * 0x100000001b3ull);
+      }
+    }
+    key += '\0' + std::to_string(roots);
+  }
+  return cache_.candidates.get_or_compute(key, resolve);
+}
+
+std::vector<Candidate>
+Resolver::find_candidates(
+    const IncludeStmt &include, const SourceFile &file, size_t max_candidates,
+    const std::vector<IncludePath> *include_paths) const {
+  const std::vector<IncludePath> &roots =
+      include_paths ? *include_paths : include_paths_;
+  auto matches = cache_.matches.get_or_compute(include.path, [&]() {
+    return index_.find(include.path, options_.fuzzy);
+  });
+  std::vector<Candidate> candidates = fix_include(
+      include, file, roots, index_, *matches, options_.prefer_relative_to_root,
+      max_candidates, write_back_);
+  if (candidates.empty() && content_matcher_) {
+    std::vector<HeaderMatch> by_content =
+        content_matcher_->find(include, index_);
+    if (!by_content.empty()) {
+      candidates = fix_include(include, file, roots, index_, by_content,
+                               options_.prefer_relative_to_root,
+                               max_candidates, write_back_);
+    }
+  }
+  return candidates;
+}
+
+/* The path of a header relative to the containing file, and its distance
+ * to the include, which exceeds bound when it is bound + 1. Both are the same
+ * for every search path the header is found in. */
+struct RelativeDistance {
+  std::optional<fs::path> path;
+  int distance{0};
+  int bound{-1};
+};
+
+/* Purely lexical: both the candidate and the containing file were
+ * canonicalized once, and Vfs::relative(candidate, containing_file) is their
+ * lexical difference. Distances over max_distance are returned as
+ * max_distance + 1. The distance relative to the file is taken from
+ * relative, or computed into it. */
+static int calculate_path_distance(const SourceFile &containing_file,
+                                   const IncludeStmt &current,
+                                   uint32_t candidate,
+                                   const std::string &candidate_relative,
+                                   const HeaderIndex &index, int max_distance,
+                                   RelativeDistance &relative) {
+  int dist_relative = 9999999;
+  {
+    fs::path full_path = index.root(candidate).path / candidate_relative;
+    if (!relative.path) {
+      relative.path = index.components().relative(
+          index.canonical_dir(candidate), index.canonical_name(candidate),
+          containing_file.canonical(index));
+    }
+    if (*relative.path != full_path) {
+      if (relative.bound < max_distance && relative.distance > relative.bound) {
+        relative.distance = bounded_levenshtein_distance(
+            current.path, relative.path->string(), max_distance);
+        relative.bound = max_distance;
+      }
+      dist_relative = relative.distance > max_distance ? max_distance + 1
+                                                       : relative.distance;
+    }
+  }
+
+  int dist_root =
+      bounded_levenshtein_distance(current.path, candidate_relative,
+                                   max_distance);
+  return std::min(dist_relative, dist_root);
+}
+
+std::vector<Candidate> fix_include(const IncludeStmt &include,
+                                   const SourceFile &file,
+                                   const std::vector<IncludePath> &include_paths,
+                                   const HeaderIndex &index,
+                                   const std::vector<HeaderMatch> &matches,
+                                   bool prefer_relative_to_root,
+                                   size_t max_candidates,
+                                   const WriteBack *write_back) {
+  std::vector<Candidate> candidates;
+
+  fs::path dir = file.path.parent_path();
+  if (!include.system) {
+    /* Check if the file is in this directory */
+    fs::path local = dir / include.path;
+    const Vfs &vfs = file.vfs();
+    if (write_back ? write_back->exists(local, vfs) : vfs.exists(local)) {
+      if (prefer_relative_to_root) {
+        // First find a root to rewrite it to.
+        bool found = false;
+        for (const IncludePath &root : include_paths) {
+          if (!root.system) {
+            fs::path rel = vfs.relative(local, root.path);
+            count(Stat::FsRelativeCalls);
+            std::string relpath = rel.string();
+            if (rel != local &&
+                (relpath.size() < 3 || relpath.substr(0, 2) != "..")) {
+              candidates.push_back({root, relpath, 0, 0});
+              found = true;
+            }
+          }
+        }
+        if (!found) {
+          // Not preferred, but still the only match available.
+          candidates.push_back({IncludePath{dir, false}, include.path, 0, 0});
+        }
+      } else {
+        candidates.push_back({IncludePath{dir, false}, include.path, 0, 0});
+      }
+    }
+  }
+
+  /* Candidates rank by weighted distance, and on a tie by the order they are
+   * found in: local ones first, then the matches in index order. The best
+   * max_candidates are kept in a heap, with the worst of them on top. */
+  using Rank = std::pair<int, size_t>;
+  std::vector<std::pair<Rank, Candidate>> best;
+  size_t limit = max_candidates ? max_candidates : SIZE_MAX;
+  auto by_rank = [](const auto &a, const auto &b) { return a.first < b.first; };
+  auto keep = [&](Rank rank, Candidate cand) {
+    if (best.size() == limit) {
+      std::pop_heap(best.begin(), best.end(), by_rank);
+      best.pop_back();
+    }
+    best.push_back({rank, std::move(cand)});
+    std::push_heap(best.begin(), best.end(), by_rank);
+  };
+  size_t num_local = candidates.size();
+  for (size_t i = 0; i < num_local; ++i) {
+    keep({candidates[i].weighted_distance(), i}, std::move(candidates[i]));
+  }
+
+  /* Try to find a header that is within the same implied folder or subfolder
+   * thereof from the given file we are processing. The folder distance is
+   * never negative, so filename_distance * 200 is a lower bound of the
+   * weighted distance: matches are visited by it, and once the heap is full
+   * the folder distance is only computed up to what would still beat its
+   * top. */
+  /* A header under nested search paths is a candidate from each of them. */
+  std::unordered_map<uint32_t, RelativeDistance> relative_distances;
+  std::vector<uint32_t> order(matches.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+    return matches[a].filename_distance < matches[b].filename_distance;
+  });
+  for (size_t n = 0; n < order.size(); ++n) {
+    uint32_t i = order[n];
+    const HeaderMatch &match = matches[i];
+    Rank lower{match.filename_distance * 200, num_local + i};
+    int max_folder_distance = INT32_MAX;
+    if (best.size() == limit) {
+      const Rank &worst = best.front().first;
+      if (lower.first > worst.first) {
+        count(Stat::CandidatesPruned, order.size() - n);
+        break;
+      } else if (!(lower < worst)) {
+        count(Stat::CandidatesPruned);
+        continue;
+      }
+      max_folder_distance = worst.first - lower.first;
+    }
+    Candidate cand{index.root(match.entry), index.relative(match.entry),
+                   match.filename_distance};
+    RelativeDistance unshared;
+    RelativeDistance &relative =
+        index.num_files() < index.num_entries()
+            ? relative_distances[index.file(match.entry)]
+            : unshared;
+    cand.folder_distance =
+        calculate_path_distance(file, include, match.entry, cand.header,
+                                index, max_folder_distance, relative);
+    Rank rank{cand.weighted_distance(), lower.second};
+    if (best.size() == limit && !(rank < best.front().first)) {
+      count(Stat::CandidatesPruned);
+      continue;
+    }
+    keep(rank, std::move(cand));
+  }
+
+  std::sort(best.begin(), best.end(), by_rank);
+  candidates.clear();
+  for (auto &[rank, cand] : best) {
+    candidates.push_back(std::move(cand));
+  }
+  return candidates;
+}
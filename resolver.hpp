@@ -0,0 +1,236 @@
+#pragma once
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <vector>
+
+#include "fingerprint.hpp"
+#include "header_index.hpp"
+#include "move_map.hpp"
+#include "report.hpp"
+#include "resolution_cache.hpp"
+#include "sfincludes.hpp"
+#include "stats.hpp"
+#include "vfs.hpp"
+#include "write_back.hpp"
+
+/* The headers found in every include search path. Plain strings: a fs::path
+ * also allocates its list of components. */
+using HeaderMap = std::map<IncludePath, std::vector<std::string>>;
+
+/* The headers under dir, in directory order, skipping what the traversal
+ * options ignore. */
+void find_headers(const fs::path &dir, std::vector<std::string> &headers,
+                  const Options &options);
+
+bool has_source_extension(const fs::path &file);
+
+/* All files under dir which process_dir() processes, in directory order. */
+std::vector<fs::path> find_sources(const fs::path &dir,
+                                   const Options &options);
+
+/* An #include or #include_next line, split around the included path. */
+struct IncludeLine {
+  std::string_view path;
+  std::string_view path_with_quotes;
+  std::string_view behind_path;
+  bool system{false};
+  bool next{false}; // #include_next
+};
+
+/* Parses a directive line starting with '#', with any blanks around the
+ * directive name. Only #include "" lines, and #include <> lines when
+ * process_system_includes, are returned; as are the same #include_next
+ * lines. */
+std::optional<IncludeLine> parse_include_line(std::string_view line,
+                                              bool process_system_includes);
+
+/* The includes of file which process_file() fixes. */
+std::vector<IncludeStmt> scan_includes(const fs::path &file,
+                                       const Options &options);
+
+/* A file to process, with the include paths it is compiled with. Without,
+ * all include paths of the resolver apply. */
+struct SourceTask {
+  fs::path file;
+  std::shared_ptr<const std::vector<IncludePath>> include_paths{};
+};
+
+/* A file being processed, with what is derived from its path on demand. The
+ * filesystem is queried through vfs, which must outlive it. */
+struct SourceFile {
+  SourceFile(fs::path path, const Vfs &vfs)
+      : path(std::move(path)), is_symlink(vfs.is_symlink(this->path)),
+        vfs_(&vfs) {}
+
+  fs::path path;
+  bool is_symlink{false};
+
+  const Vfs &vfs() const { return *vfs_; }
+
+  /* Vfs::weakly_canonical(path), split into components of the index. */
+  const ComponentPath &canonical(const HeaderIndex &index) const {
+    if (!canonical_) {
+      canonical_ = index.components().lookup(vfs_->weakly_canonical(path));
+      count(Stat::FsRelativeCalls);
+    }
+    return *canonical_;
+  }
+
+private:
+  const Vfs *vfs_;
+  mutable std::optional<ComponentPath> canonical_;
+};
+
+/* The headers an include could refer to, best first: all of them, or the
+ * best max_candidates when that is not 0. Files next to file are looked up
+ * through the Vfs of file, as they will be once the renames in write_back, if
+ * any, are done. */
+std::vector<Candidate> fix_include(const IncludeStmt &include,
+                                   const SourceFile &file,
+                                   const std::vector<IncludePath> &include_paths,
+                                   const HeaderIndex &index,
+                                   const std::vector<HeaderMatch> &matches,
+                                   bool prefer_relative_to_root,
+                                   size_t max_candidates = 0,
+                                   const WriteBack *write_back = nullptr);
+
+/* Memoizes fix_include() for all files in the same directory (see
+ * Resolver::resolve()), and the index lookup for all files. */
+struct ResolutionCache {
+  MemoCache<std::vector<HeaderMatch>> matches;
+  MemoCache<std::vector<Candidate>> candidates;
+};
+
+/* Resolves and fixes includes against an indexed set of headers. All const
+ * member functions are safe to call from several threads at once. */
+class Resolver {
+public:
+  /* The filesystem is queried through vfs, which must outlive the resolver,
+   * from indexing the headers on. */
+  Resolver(const Options &options, std::vector<IncludePath> include_paths,
+           HeaderMap headers, const Vfs &vfs = disk_vfs());
+
+  Resolver(const Resolver &) = delete;
+  Resolver &operator=(const Resolver &) = delete;
+
+  const Options &options() const { return options_; }
+  const std::vector<IncludePath> &include_paths() const {
+    return include_paths_;
+  }
+  const HeaderIndex &index() const { return index_; }
+  const ResolutionCache &cache() const { return cache_; }
+  const Vfs &vfs() const { return *vfs_; }
+
+  /* The candidates for an include in file, best first: the fix, and up to
+   * Options::max_alternatives alternatives. An include found next to the
+   * file is rewritten relative to one of the given include paths, if any,
+   * or else to any include path of the resolver. */
+  CandidateList
+  resolve(const IncludeStmt &include, const SourceFile &file,
+          const std::vector<IncludePath> *include_paths = nullptr) const;
+
+  /* How the include would be rewritten, counted into result. The line of the
+   * report is left 0. Only headers in the given include paths, if any, or in
+   * the directory of the file are considered. An include of a header in the
+   * move map is rewritten to its new path, without resolving it. One that
+   * matches no header is looked up by its contents, if a content matcher is
+   * set. */
+  IncludeReport
+  fix(const IncludeStmt &include, const SourceFile &file, ProcessResult *result,
+      const std::vector<IncludePath> *include_paths = nullptr) const;
+
+  /* Fixes all includes in file, and writes it back unless dry_run: staged in
+   * the write-back, if one is set, or else right away. */
+  void process_file(const SourceTask &task, ProcessResult *result,
+                    FileReport *report) const;
+  void process_file(const fs::path &file, ProcessResult *result,
+                    FileReport *report) const {
+    process_file(SourceTask{file}, result, report);
+  }
+
+  /* process_file() for all tasks, on options().jobs threads. The reports are
+   * handed to on_report on the calling thread, in the order of the tasks. */
+  ProcessResult
+  process_files(const std::vector<SourceTask> &tasks,
+                const std::function<void(const FileReport &)> &on_report) const;
+
+  /* process_files() for the sources listed by find_sources(), in that
+   * order. With Options::num_shards, only those in Options::shard. */
+  ProcessResult process_sources(
+      std::vector<fs::path> sources,
+      const std::function<void(const FileReport &)> &on_report) const;
+
+  /* process_sources() for all sources in dir. */
+  ProcessResult
+  process_dir(const fs::path &dir,
+              const std::function<void(const FileReport &)> &on_report) const;
+
+  /* process_files() for the tasks, and then for the user headers they reach,
+   * transitively. A header is processed once, with the include paths of the
+   * first task reaching it. Headers are only reached from tasks with include
+   * paths, unless Options::record_includes. With Options::num_shards, only
+   * the tasks in Options::shard are processed, and all headers they reach. */
+  ProcessResult process_reachable(
+      const std::vector<SourceTask> &tasks,
+      const std::function<void(const FileReport &)> &on_report) const;
+
+  /* Updates the index for a header that was created, under every include
+   * path containing it, or for a header or directory that was removed. The
+   * memoized resolutions are dropped. These must not run concurrently with
+   * any other call. remove_headers() returns the filenames removed. */
+  void add_header(const fs::path &header);
+  std::vector<std::string> remove_headers(const fs::path &path);
+
+  /* Stages the files process_file() changes in write_back, to be committed
+   * together, instead of writing each one as it is fixed. Includes are
+   * resolved as if its renames were done. Not safe to call concurrently with
+   * any other call; nullptr writes files right away again. */
+  void set_write_back(WriteBack *write_back) {
+    write_back_ = write_back;
+    cache_.candidates.clear();
+  }
+
+  /* Queries the filesystem through vfs from now on: a snapshot no longer
+   * holds once files were moved. The memoized resolutions are dropped. Not
+   * safe to call concurrently with any other call. */
+  void set_vfs(const Vfs &vfs) {
+    vfs_ = &vfs;
+    cache_.candidates.clear();
+  }
+
+  /* Headers known to have moved. Not safe to call concurrently with any
+   * other call. */
+  void set_move_map(const MoveMap *move_map) { move_map_ = move_map; }
+
+  /* Looks up includes that match no header by the contents of their old
+   * version, which content_matcher must have fingerprinted this index for.
+   * Not safe to call concurrently with any other call. */
+  void set_content_matcher(const ContentMatcher *content_matcher) {
+    content_matcher_ = content_matcher;
+    cache_.candidates.clear();
+  }
+
+private:
+  /* The fix and the alternatives kept of the candidates: 0 for all. */
+  size_t max_candidates() const {
+    return options_.max_alternatives < 0 ? 0 : options_.max_alternatives + 1;
+  }
+
+  /* fix_include() for the include, uncached. */
+  std::vector<Candidate>
+  find_candidates(const IncludeStmt &include, const SourceFile &file,
+                  size_t max_candidates,
+                  const std::vector<IncludePath> *include_paths) const;
+
+  Options options_;
+  std::vector<IncludePath> include_paths_;
+  HeaderIndex index_;
+  mutable ResolutionCache cache_;
+  WriteBack *write_back_{nullptr};
+  const MoveMap *move_map_{nullptr};
+  const ContentMatcher *content_matcher_{nullptr};
+  const Vfs *vfs_;
+};
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "levenshtein_distance.hpp"
+#include "sfincludes.hpp"
+
+/* Which source files contain which includes, such that a change to a header
+ * only has to re-resolve the files whose includes could refer to it. Keyed
+ * by the include text, like the header lookup in HeaderIndex::find(). */
+class ReverseIncludeIndex {
+public:
+  /* Replaces what was known about the includes of file. */
+  void set(const fs::path &file, const std::vector<IncludeStmt> &includes) {
+    remove(file);
+    std::vector<std::string> &texts = includes_of_[file.string()];
+    for (const IncludeStmt &include : includes) {
+      texts.push_back(include.path);
+      std::set<std::string> &users = files_with_[include.path];
+      if (users.empty()) {
+        texts_with_filename_[filename_of(include.path)].insert(include.path);
+      }
+      users.insert(file.string());
+    }
+  }
+
+  /* Forgets file, or all files under it if it is a directory. */
+  void remove(const fs::path &path) {
+    std::string exact = path.string();
+    std::string prefix = (path / "").string();
+    for (auto it = includes_of_.lower_bound(exact); it != includes_of_.end();) {
+      if (it->first == exact ||
+          it->first.compare(0, prefix.size(), prefix) == 0) {
+        it = remove(it);
+      } else if (it->first > prefix) {
+        break;
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  /* Adds the files with an include that a header with this filename could
+   * resolve, given the --fuzzy distance: the same filename, or within
+   * max_distance of the filename or full text of the include. */
+  void find_users(const std::string &filename, int max_distance,
+                  std::set<std::string> &files) const {
+    auto add_users = [&](const std::string &text) {
+      const std::set<std::string> &users = files_with_.at(text);
+      files.insert(users.begin(), users.end());
+    };
+    if (max_distance <= 0) {
+      auto texts = texts_with_filename_.find(filename);
+      if (texts != texts_with_filename_.end()) {
+        for (const std::string &text : texts->second) {
+          add_users(text);
+        }
+      }
+      return;
+    }
+    for (const auto &[text_filename, texts] : texts_with_filename_) {
+      bool filename_match = bounded_levenshtein_distance(
+                                text_filename, filename, max_distance) <=
+                            max_distance;
+      for (const std::string &text : texts) {
+        if (filename_match || bounded_levenshtein_distance(
+                                  text, filename, max_distance) <=
+                                  max_distance) {
+          add_users(text);
+        }
+      }
+    }
+  }
+
+  size_t num_files() const { return includes_of_.size(); }
+
+private:
+  using IncludesOf = std::map<std::string, std::vector<std::string>>;
+
+  IncludesOf::iterator remove(IncludesOf::iterator it) {
+    for (const std::string &text : it->second) {
+      auto files = files_with_.find(text);
+      if (files == files_with_.end()) {
+        continue; // Included twice by the same file.
+      }
+      files->second.erase(it->first);
+      if (files->second.empty()) {
+        auto texts = texts_with_filename_.find(filename_of(text));
+        texts->second.erase(text);
+        if (texts->second.empty()) {
+          texts_with_filename_.erase(texts);
+        }
+        files_with_.erase(files);
+      }
+    }
+    return includes_of_.erase(it);
+  }
+
+  static std::string filename_of(const std::string &text) {
+    return fs::path(text).filename().string();
+  }
+
+  IncludesOf includes_of_;
+  std::map<std::string, std::set<std::string>> files_with_;
+  std::map<std::string, std::set<std::string>> texts_with_filename_;
+};
@@ -0,0 +1,273 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <set>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "report.hpp"
+#include "resolver.hpp"
+#include "stats.hpp"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#define SFINCLUDES_HAVE_UNIX_SOCKETS 1
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+#endif
+
+/* Answers requests against a resolver whose header index stays in memory.
+ * Every request is one line, answered with one line of JSON:
+ *
+ *   resolve "foo.h" src/dir/file.cpp   Candidates for an include in a file.
+ *   resolve <foo.h> src/dir/file.cpp   Same, for a system include.
+ *   fix src/dir/file.cpp               process_file(): reports every include,
+ *                                      and writes the file unless dry_run.
+ *   ping
+ *   shutdown                           Stops the server.
+ *
+ * Successful answers have "ok": true, others "ok": false and an "error". */
+class RequestHandler {
+public:
+  explicit RequestHandler(const Resolver &resolver) : resolver_(resolver) {}
+
+  /* Sets stop when the request asks the server to shut down. */
+  std::string handle(std::string_view request, bool *stop) const {
+    std::ostringstream out;
+    std::string_view command = request.substr(0, request.find(' '));
+    std::string_view args = command.size() < request.size()
+                                ? request.substr(command.size() + 1)
+                                : std::string_view();
+    try {
+      if (command == "resolve") {
+        resolve(out, args);
+      } else if (command == "fix") {
+        fix(out, args);
+      } else if (command == "ping") {
+        out << "{\"ok\": true}";
+      } else if (command == "shutdown") {
+        *stop = true;
+        out << "{\"ok\": true}";
+      } else {
+        error(out, "Unknown request: " + std::string(command));
+      }
+    } catch (const std::exception &e) {
+      out.str("");
+      error(out, e.what());
+    }
+    out << '\n';
+    return out.str();
+  }
+
+private:
+  void resolve(std::ostream &out, std::string_view args) const {
+    char close = !args.empty() && args[0] == '<' ? '>' : '"';
+    size_t end = args.empty() ? std::string_view::npos : args.find(close, 1);
+    if (end == std::string_view::npos || (args[0] != '<' && args[0] != '"') ||
+        end + 2 > args.size()) {
+      error(out, "Expected: resolve \"include\" file");
+      return;
+    }
+    IncludeStmt include{std::string(args.substr(1, end - 1)), close == '>'};
+    fs::path file(args.substr(end + 2));
+    ProcessResult result{};
+    IncludeReport report = resolver_.fix(
+        include, SourceFile{file, resolver_.vfs()}, &result);
+    out << "{\"ok\": true, \"file\": ";
+    write_json_string(out, file.string());
+    out << ", ";
+    write_json_include_fields(out, report);
+    out << "}";
+  }
+
+  void fix(std::ostream &out, std::string_view args) const {
+    if (args.empty()) {
+      error(out, "Expected: fix file");
+      return;
+    }
+    ProcessResult result{};
+    FileReport report;
+    resolver_.process_file(fs::path(args), &result, &report);
+    if (report.unreadable) {
+      error(out, "Could not read file: " + std::string(args));
+      return;
+    }
+    out << "{\"ok\": true, \"file\": ";
+    write_json_string(out, report.file.string());
+    out << ", \"result\": ";
+    write_json_summary(out, result);
+    out << ", \"includes\": [";
+    for (size_t i = 0; i < report.includes.size(); ++i) {
+      out << (i ? ", " : "") << "{\"line\": " << report.includes[i].line
+          << ", ";
+      write_json_include_fields(out, report.includes[i]);
+      out << "}";
+    }
+    out << "]}";
+  }
+
+  static void error(std::ostream &out, const std::string &message) {
+    out << "{\"ok\": false, \"error\": ";
+    write_json_string(out, message);
+    out << "}";
+  }
+
+  const Resolver &resolver_;
+};
+
+#ifdef SFINCLUDES_HAVE_UNIX_SOCKETS
+
+/* Serves RequestHandler on a Unix domain socket, with a thread per
+ * connection, until a shutdown request. A socket left at socket_path by an
+ * earlier server is replaced, any other file is not. Returns the exit
+ * code. */
+inline int serve(const Resolver &resolver, const std::string &socket_path,
+                 std::ostream &log) {
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (socket_path.size() >= sizeof(addr.sun_path)) {
+    log << "Socket path too long: " << socket_path << std::endl;
+    return 1;
+  }
+  socket_path.copy(addr.sun_path, socket_path.size());
+
+  struct stat st;
+  if (::lstat(socket_path.c_str(), &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      log << "Not a socket, not replacing it: " << socket_path << std::endl;
+      return 1;
+    }
+    ::unlink(socket_path.c_str());
+  }
+  int listen_fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0 ||
+      ::bind(listen_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) !=
+          0 ||
+      ::listen(listen_fd, 64) != 0) {
+    log << "Cannot listen on: " << socket_path << std::endl;
+    if (listen_fd >= 0) {
+      ::close(listen_fd);
+    }
+    return 1;
+  }
+  log << "Serving on: " << socket_path << std::endl;
+
+  RequestHandler handler(resolver);
+  std::atomic<bool> stopping{false};
+  std::mutex mutex;
+  std::set<int> clients;
+  /* Connection threads by id. Finished ones are joined on the next accept. */
+  std::map<size_t, std::thread> threads;
+  std::vector<size_t> finished;
+
+  /* Unblocks accept() and the recv() of every connection. */
+  auto stop = [&]() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (stopping.exchange(true)) {
+      return;
+    }
+    ::shutdown(listen_fd, SHUT_RDWR);
+    for (int fd : clients) {
+      ::shutdown(fd, SHUT_RDWR);
+    }
+  };
+
+  auto connection = [&](size_t id, int fd) {
+    std::string buffer;
+    char chunk[4096];
+    bool stop_requested = false;
+    ssize_t n;
+    while (!stop_requested && (n = ::recv(fd, chunk, sizeof(chunk), 0)) > 0) {
+      buffer.append(chunk, n);
+      size_t begin = 0, end;
+      while (!stop_requested &&
+             (end = buffer.find('\n', begin)) != std::string::npos) {
+        std::string_view request(buffer.data() + begin, end - begin);
+        if (!request.empty() && request.back() == '\r') {
+          request.remove_suffix(1);
+        }
+        std::string response = handler.handle(request, &stop_requested);
+        for (size_t sent = 0; sent < response.size();) {
+          ssize_t w = ::send(fd, response.data() + sent,
+                             response.size() - sent, MSG_NOSIGNAL);
+          if (w <= 0) {
+            break;
+          }
+          sent += w;
+        }
+        begin = end + 1;
+      }
+      buffer.erase(0, begin);
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      clients.erase(fd);
+    }
+    ::close(fd);
+    flush_thread_stats();
+    if (stop_requested) {
+      stop();
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    finished.push_back(id);
+  };
+
+  for (size_t id = 0;; ++id) {
+    int fd = ::accept(listen_fd, nullptr, nullptr);
+    if (fd < 0) {
+      if (stopping) {
+        break;
+      }
+      /* Out of descriptors or memory: retrying right away would spin until
+       * connections close, so wait a little. */
+      if (errno != EINTR && errno != ECONNABORTED) {
+        log << "Cannot accept a connection: " << std::strerror(errno)
+            << std::endl;
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      }
+      continue;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    if (stopping) {
+      ::close(fd);
+      break;
+    }
+    for (size_t done : finished) {
+      threads[done].join();
+      threads.erase(done);
+    }
+    finished.clear();
+    clients.insert(fd);
+    threads.emplace(id, std::thread(connection, id, fd));
+  }
+
+  for (auto &[id, thread] : threads) {
+    thread.join();
+  }
+  ::close(listen_fd);
+  ::unlink(socket_path.c_str());
+  return 0;
+}
+
+#else
+
+inline int serve(const Resolver &resolver, const std::string &socket_path,
+                 std::ostream &log) {
+  log << "--serve needs Unix domain sockets." << std::endl;
+  return 1;
+}
+
+#endif
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+/* 64-bit FNV-1a: the same on every machine and in every run, unlike
+ * std::hash. */
+inline uint64_t fnv1a_hash(std::string_view data) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (char c : data) {
+    hash ^= static_cast<unsigned char>(c);
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+inline bool has_header_extension(const fs::path &file) {
+  fs::path ext = file.extension();
+  return ext == ".h" || ext == ".hpp";
+}
+
+/* Options are only written while parsing the command line, before any worker
+ * thread is started, and are read-only afterwards. */
+struct Options {
+  int fuzzy{0};
+  int max_alternatives{-1}; // candidates kept besides the fix; negative: all
+  int jobs{1};
+  bool dry_run{true};
+  bool verbose{false};
+  bool process_system_includes{false};
+  bool system_to_user{false};
+  bool user_to_system{false};
+  bool prefer_relative_to_root{false};
+  bool omit_untouched{false};
+  bool omit_system_failed{false};
+  bool record_includes{false}; // fill FileReport::reached for every file
+  // Traversal of the source and include directories (see walk_tree()).
+  std::vector<std::string> exclude{}; // .gitignore style patterns
+  bool gitignore{true};               // skip what .gitignore files ignore
+  int follow_symlinks{0};             // directory symlinks followed in a row
+  // Sharded runs (see shard.hpp): only the sources in shard of num_shards
+  // are processed.
+  int shard{0};
+  int num_shards{1};
+  bool record_edits{false}; // fill FileReport::edits and content_hash
+};
+
+struct ProcessResult {
+  size_t total{0};
+  size_t replaced_path{0};
+  size_t system_to_user{0};
+  size_t user_to_system{0};
+  size_t untouched{0};
+  size_t failed{0};
+};
+
+inline void accumulate(ProcessResult *r, const ProcessResult &term) {
+  r->total += term.total;
+  r->replaced_path += term.replaced_path;
+  r->system_to_user += term.system_to_user;
+  r->user_to_system += term.user_to_system;
+  r->untouched += term.untouched;
+  r->failed += term.failed;
+}
+
+struct IncludePath {
+  fs::path path;
+  bool system{false};
+
+  bool operator<(const IncludePath &other) const { return path < other.path; }
+};
+
+struct IncludeStmt {
+  std::string path;
+  bool system{false};
+};
+
+struct Candidate {
+  IncludePath search_path{};
+  std::string header{};
+  int filename_distance{};
+  int folder_distance{};
+
+  int weighted_distance() const {
+    return filename_distance * 200 + folder_distance;
+  }
+};
+
+using CandidateList = std::shared_ptr<const std::vector<Candidate>>;
@@ -0,0 +1,431 @@
+#pragma once
+
+#include <algorithm>
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <cstdint>
+#include <fstream>
+#include <optional>
+#include <ostream>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "mapped_file.hpp"
+#include "report.hpp"
+#include "resolver.hpp"
+#include "sfincludes.hpp"
+#include "write_back.hpp"
+
+/* The shard a source file belongs to, by the hash of its path as it was
+ * found (lexically normal, '/' separated): all shards of a run must be given
+ * the same sources, from the same working directory. */
+inline int shard_of(const fs::path &file, int num_shards) {
+  return fnv1a_hash(file.lexically_normal().generic_string()) % num_shards;
+}
+
+inline bool in_shard(const fs::path &file, const Options &options) {
+  return options.num_shards <= 1 ||
+         shard_of(file, options.num_shards) == options.shard;
+}
+
+/* Whether shard i of N exists: 0 <= i < N. */
+inline bool valid_shard(int shard, int num_shards) {
+  return num_shards > 0 && shard >= 0 && shard < num_shards;
+}
+
+/* Parses "i/N", with 0 <= i < N. */
+inline bool parse_shard(const std::string &spec, int *shard, int *num_shards) {
+  size_t slash = spec.find('/');
+  if (slash == std::string::npos) {
+    return false;
+  }
+  try {
+    size_t end_i, end_n;
+    *shard = std::stoi(spec.substr(0, slash), &end_i);
+    *num_shards = std::stoi(spec.substr(slash + 1), &end_n);
+    if (end_i != slash || end_n != spec.size() - slash - 1) {
+      return false;
+    }
+  } catch (const std::logic_error &) {
+    return false;
+  }
+  return valid_shard(*shard, *num_shards);
+}
+
+/* The partial result of a shard, which --merge combines with those of the
+ * other shards: JSON Lines like the jsonl report, with the counters and the
+ * edits of every file (offsets into its contents, which have the hash in
+ * "content_hash"), and the full report of every include.
+ *
+ *   {"type": "shard", "version": 1, "shard": 0, "of": 4}
+ *   {"type": "rename", "old": ..., "new": ...}
+ *   {"type": "file", "file": ..., "unreadable": false, "result": {...},
+ *    "content_hash": ..., "edits": [...], "includes": [...]}
+ *   {"type": "summary", "result": {...}}
+ *
+ * The summary line comes last: a file without one is incomplete. */
+class ShardResultWriter : public ReportWriter {
+public:
+  static constexpr int VERSION = 1;
+
+  ShardResultWriter(int shard, int num_shards)
+      : shard_(shard), num_shards_(num_shards) {}
+
+  void begin(std::ostream &out) override {
+    out << "{\"type\": \"shard\", \"version\": " << VERSION
+        << ", \"shard\": " << shard_ << ", \"of\": " << num_shards_ << "}\n";
+  }
+
+  void rename(std::ostream &out, const fs::path &from,
+              const fs::path &to) override {
+    out << "{\"type\": \"rename\", \"old\": ";
+    write_json_string(out, from.string());
+    out << ", \"new\": ";
+    write_json_string(out, to.string());
+    out << "}\n";
+  }
+
+  void file(std::ostream &out, const FileReport &report) override {
+    out << "{\"type\": \"file\", \"file\": ";
+    write_json_string(out, report.file.string());
+    out << ", \"unreadable\": " << (report.unreadable ? "true" : "false")
+        << ", \"result\": ";
+    write_json_summary(out, report.result);
+    out << ", \"content_hash\": " << report.content_hash << ", \"edits\": [";
+    for (size_t i = 0; i < report.edits.size(); ++i) {
+      const TextEdit &edit = report.edits[i];
+      out << (i > 0 ? ", " : "") << "{\"offset\": " << edit.offset
+          << ", \"length\": " << edit.length << ", \"replacement\": ";
+      write_json_string(out, edit.replacement);
+      out << "}";
+    }
+    out << "], \"includes\": [";
+    for (size_t i = 0; i < report.includes.size(); ++i) {
+      const IncludeReport &inc = report.includes[i];
+      out << (i > 0 ? ", " : "") << "{\"line\": " << inc.line << ", ";
+      write_json_include_fields(out, inc);
+      out << "}";
+    }
+    out << "]}\n";
+  }
+
+  void end(std::ostream &out, const ProcessResult &summary) override {
+    out << "{\"type\": \"summary\", \"result\": ";
+    write_json_summary(out, summary);
+    out << "}\n";
+  }
+
+private:
+  int shard_;
+  int num_shards_;
+};
+
+/* A partial result read back, or all of them merged. */
+struct ShardResult {
+  int shard{0};
+  int num_shards{1};
+  std::vector<std::pair<fs::path, fs::path>> renames{};
+  std::vector<FileReport> files{};
+  ProcessResult summary{};
+};
+
+namespace shard_json {
+
+namespace pt = boost::property_tree;
+
+inline ProcessResult read_summary(const pt::ptree &json) {
+  ProcessResult r;
+  r.total = json.get<size_t>("total");
+  r.replaced_path = json.get<size_t>("replaced_path");
+  r.system_to_user = json.get<size_t>("system_to_user");
+  r.user_to_system = json.get<size_t>("user_to_system");
+  r.untouched = json.get<size_t>("untouched");
+  r.failed = json.get<size_t>("failed");
+  return r;
+}
+
+inline Candidate read_candidate(const pt::ptree &json) {
+  Candidate c;
+  c.header = json.get<std::string>("header");
+  c.filename_distance = json.get<int>("filename_distance");
+  c.folder_distance = json.get<int>("folder_distance");
+  c.search_path.path = json.get<std::string>("search_root");
+  c.search_path.system = json.get<bool>("system");
+  return c;
+}
+
+inline IncludeReport read_include(const pt::ptree &json) {
+  IncludeReport inc;
+  inc.line = json.get<size_t>("line");
+  std::string action = json.get<std::string>("action");
+  int a = 0;
+  while (action != action_name(IncludeAction(a))) {
+    if (IncludeAction(a) == IncludeAction::Failed) {
+      throw std::runtime_error("unknown action " + action);
+    }
+    a++;
+  }
+  inc.action = IncludeAction(a);
+  inc.old_include = json.get<std::string>("old");
+  auto candidates = std::make_shared<std::vector<Candidate>>();
+  if (inc.action != IncludeAction::Failed) {
+    inc.new_include = json.get<std::string>("new");
+    candidates->push_back(read_candidate(json.get_child("fix")));
+    for (const auto &[key, alt] : json.get_child("alternatives")) {
+      candidates->push_back(read_candidate(alt));
+    }
+  }
+  inc.candidates = std::move(candidates);
+  return inc;
+}
+
+inline FileReport read_file(const pt::ptree &json) {
+  FileReport report;
+  report.file = json.get<std::string>("file");
+  report.unreadable = json.get<bool>("unreadable");
+  report.result = read_summary(json.get_child("result"));
+  report.content_hash = json.get<uint64_t>("content_hash");
+  for (const auto &[key, edit] : json.get_child("edits")) {
+    report.edits.push_back({edit.get<size_t>("offset"),
+                            edit.get<size_t>("length"),
+                            edit.get<std::string>("replacement")});
+  }
+  for (const auto &[key, inc] : json.get_child("includes")) {
+    report.includes.push_back(read_include(inc));
+  }
+  return report;
+}
+
+} // namespace shard_json
+
+/* Reads a file written by ShardResultWriter. Throws std::runtime_error when
+ * it is malformed or incomplete. */
+inline ShardResult load_shard_result(const fs::path &path) {
+  namespace pt = boost::property_tree;
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    throw std::runtime_error("cannot open " + path.string());
+  }
+  ShardResult result;
+  bool begun = false, ended = false;
+  std::string line;
+  for (size_t number = 1; std::getline(in, line); ++number) {
+    try {
+      std::istringstream json_line(line);
+      pt::ptree json;
+      pt::read_json(json_line, json);
+      std::string type = json.get<std::string>("type");
+      if (type == "shard" && !begun) {
+        if (json.get<int>("version") != ShardResultWriter::VERSION) {
+          throw std::runtime_error("unsupported version");
+        }
+        result.shard = json.get<int>("shard");
+        result.num_shards = json.get<int>("of");
+        if (!valid_shard(result.shard, result.num_shards)) {
+          throw std::runtime_error(
+              "invalid shard " + std::to_string(result.shard) + "/" +
+              std::to_string(result.num_shards));
+        }
+        begun = true;
+      } else if (!begun || ended) {
+        throw std::runtime_error("unexpected line");
+      } else if (type == "rename") {
+        result.renames.push_back(
+            {json.get<std::string>("old"), json.get<std::string>("new")});
+      } else if (type == "file") {
+        result.files.push_back(shard_json::read_file(json));
+      } else if (type == "summary") {
+        result.summary = shard_json::read_summary(json.get_child("result"));
+        ended = true;
+      } else {
+        throw std::runtime_error("unknown type " + type);
+      }
+    } catch (const std::exception &e) {
+      throw std::runtime_error(path.string() + ":" + std::to_string(number) +
+                               ": " + e.what());
+    }
+  }
+  if (!ended) {
+    throw std::runtime_error(path.string() +
+                             ": incomplete, the shard did not finish");
+  }
+  return result;
+}
+
+/* Combines the partial results of all shards of a run: the renames (which
+ * every shard made alike), the reports ordered by path and the counters of
+ * these reports. A file reported by several shards, such as a header reached
+ * from translation units of each, keeps the report of the first shard.
+ * Returns nothing, after logging why, when shards are missing or do not
+ * belong together. */
+inline std::optional<ShardResult>
+merge_shard_results(std::vector<ShardResult> shards, std::ostream &log) {
+  std::sort(shards.begin(), shards.end(),
+            [](const ShardResult &a, const ShardResult &b) {
+              return a.shard < b.shard;
+            });
+  int num_shards = shards.empty() ? 0 : shards[0].num_shards;
+  std::vector<int> given(num_shards, 0);
+  for (const ShardResult &shard : shards) {
+    if (!valid_shard(shard.shard, shard.num_shards)) {
+      log << RED << "ERROR: Shard " << shard.shard << "/" << shard.num_shards
+          << " does not exist." << CLEAR << std::endl;
+      return std::nullopt;
+    }
+    if (shard.num_shards != num_shards) {
+      log << RED << "ERROR: Shard " << shard.shard << "/" << shard.num_shards
+          << " is not of the same run as shard " << shards[0].shard << "/"
+          << num_shards << "." << CLEAR << std::endl;
+      return std::nullopt;
+    }
+    if (given[shard.shard]++) {
+      log << RED << "ERROR: Shard " << shard.shard << "/" << num_shards
+          << " is given twice." << CLEAR << std::endl;
+      return std::nullopt;
+    }
+  }
+  for (int i = 0; i < num_shards; ++i) {
+    if (!given[i]) {
+      log << RED << "ERROR: Shard " << i << "/" << num_shards
+          << " is missing." << CLEAR << std::endl;
+      return std::nullopt;
+    }
+  }
+
+  ShardResult merged;
+  std::set<std::pair<fs::path, fs::path>> renamed;
+  std::vector<std::pair<std::string, FileReport>> files;
+  for (ShardResult &shard : shards) {
+    for (auto &rename : shard.renames) {
+      if (renamed.insert(rename).second) {
+        merged.renames.push_back(std::move(rename));
+      }
+    }
+    for (FileReport &report : shard.files) {
+      std::string key = report.file.lexically_normal().string();
+      files.push_back({std::move(key), std::move(report)});
+    }
+  }
+  std::stable_sort(
+      files.begin(), files.end(),
+      [](const auto &a, const auto &b) { return a.first < b.first; });
+  files.erase(std::unique(files.begin(), files.end(),
+                          [](const auto &a, const auto &b) {
+                            return a.first == b.first;
+                          }),
+              files.end());
+  for (auto &[key, report] : files) {
+    accumulate(&merged.summary, report.result);
+    merged.files.push_back(std::move(report));
+  }
+  return merged;
+}
+
+/* Stages the renames and the edits of a merged result in write_back, reading
+ * the files on jobs threads. The edits only apply to the contents the shards
+ * saw: when a file changed since, nothing is staged. */
+inline bool stage_shard_edits(const ShardResult &merged, WriteBack &write_back,
+                              int jobs, std::ostream &log) {
+  std::vector<std::string> errors(merged.files.size());
+  std::vector<std::string> contents(merged.files.size());
+  journal::parallel_for(merged.files.size(), jobs, [&](size_t i) {
+    const FileReport &report = merged.files[i];
+    if (report.edits.empty()) {
+      return;
+    }
+    MappedFile in(report.file);
+    if (!in.good()) {
+      errors[i] = "Cannot read " + report.file.string();
+    } else if (fnv1a_hash(in.view()) != report.content_hash) {
+      errors[i] = report.file.string() + " changed since its shard ran";
+    } else {
+      contents[i] = apply_edits(in.view(), report.edits);
+    }
+  });
+  bool good = true;
+  for (const std::string &error : errors) {
+    if (!error.empty()) {
+      log << RED << "ERROR: " << error << CLEAR << std::endl;
+      good = false;
+    }
+  }
+  if (!good) {
+    log << RED << "Nothing was changed." << CLEAR << std::endl;
+    return false;
+  }
+  for (const auto &[from, to] : merged.renames) {
+    write_back.rename(from, to);
+  }
+  for (size_t i = 0; i < merged.files.size(); ++i) {
+    if (!merged.files[i].edits.empty()) {
+      write_back.write(merged.files[i].file, std::move(contents[i]));
+    }
+  }
+  return true;
+}
+
+/* A header index shared by the shards of a run, such that only one process
+ * walks the include paths: the headers of every include path, as listed by
+ * find_headers(). Lines of tab separated fields, escaped as in the undo
+ * journal:
+ *
+ *   root <0 or 1: system> <include path>
+ *        <header, relative to the include path above>
+ */
+namespace header_index_file {
+constexpr std::string_view MAGIC = "sfincludes header index 1";
+}
+
+inline bool save_header_index(const fs::path &path, const HeaderMap &headers) {
+  fs::path tmp = path;
+  tmp += ".tmp";
+  {
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    out << header_index_file::MAGIC << '\n';
+    for (const auto &[inc, hdrs] : headers) {
+      out << "root\t" << (inc.system ? 1 : 0) << '\t'
+          << journal::escape(inc.path.string()) << '\n';
+      /* The headers were found as root / relative. */
+      size_t root_length = (inc.path / "").native().size();
+      for (const std::string &header : hdrs) {
+        out << '\t' << journal::escape(header.substr(root_length)) << '\n';
+      }
+    }
+    out.close();
+    if (!out) {
+      return false;
+    }
+  }
+  std::error_code ec;
+  fs::rename(tmp, path, ec);
+  return !ec;
+}
+
+/* Throws std::runtime_error on a malformed file. */
+inline HeaderMap load_header_index(const fs::path &path) {
+  std::ifstream in(path, std::ios::binary);
+  std::string line;
+  if (!in || !std::getline(in, line) || line != header_index_file::MAGIC) {
+    throw std::runtime_error("no header index in " + path.string());
+  }
+  HeaderMap headers;
+  std::vector<std::string> *hdrs = nullptr;
+  std::string root;
+  while (std::getline(in, line)) {
+    std::vector<std::string> fields = journal::split_fields(line);
+    if (fields.size() == 3 && fields[0] == "root") {
+      IncludePath inc{fields[2], fields[1] == "1"};
+      root = (inc.path / "").native();
+      hdrs = &headers[inc];
+    } else if (fields.size() == 2 && fields[0].empty() && hdrs) {
+      hdrs->push_back(root + fields[1]);
+    } else {
+      throw std::runtime_error("malformed header index line: " + line);
+    }
+  }
+  return headers;
+}
@@ -0,0 +1,225 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#include <time.h>
+#define SFINCLUDES_HAVE_RUSAGE 1
+#endif
+
+/* Phases of a run, as reported by --stats. Nested phases are accounted
+ * exclusively: time spent resolving includes is not also counted as time
+ * spent scanning the file that contains them. */
+enum class Phase {
+  Index,
+  Rename,
+  Traversal,
+  Scan,
+  Resolve,
+  WriteBack,
+  Analysis,
+  NUM_PHASES
+};
+
+enum class Stat {
+  FilesScanned,
+  BytesRead,
+  Includes,
+  MovedIncludes, // found in the move map
+  ContentMatches, // missing headers found by the contents of their old version
+  Candidates,
+  CandidatesPruned, // matches ranked out without their full folder distance
+  LevenshteinCalls,
+  LevenshteinCells,
+  FsRelativeCalls, // fs::relative and fs::weakly_canonical: these hit the disk
+                   // unless a SnapshotVfs answers them
+  DirectoriesListed, // read into a SnapshotVfs
+  SkippedDirectories, // ignored by .gitignore or --exclude
+  SkippedFiles,
+  NUM_STATS
+};
+
+inline const char *phase_name(Phase p) {
+  const char *names[] = {"index",   "rename",  "traversal", "scan",
+                         "resolve", "write_back", "analysis"};
+  return names[int(p)];
+}
+
+inline const char *stat_name(Stat s) {
+  const char *names[] = {"files_scanned",       "bytes_read",
+                         "includes",            "moved_includes",
+                         "content_matches",     "candidates",
+                         "candidates_pruned",   "levenshtein_calls",
+                         "levenshtein_cells",   "fs_relative_calls",
+                         "directories_listed",  "skipped_directories",
+                         "skipped_files"};
+  return names[int(s)];
+}
+
+/* Per-thread counters. Trivially constructible, so that counting in hot code
+ * is a plain increment of a thread-local variable. Worker threads hand their
+ * numbers over with flush_thread_stats() before they exit. */
+struct ThreadStats {
+  uint64_t stats[int(Stat::NUM_STATS)];
+  int64_t wall_ns[int(Phase::NUM_PHASES)];
+  int64_t cpu_ns[int(Phase::NUM_PHASES)];
+  int current_phase;
+  int64_t last_wall_ns;
+  int64_t last_cpu_ns;
+};
+
+inline thread_local ThreadStats thread_stats{{}, {}, {}, -1, 0, 0};
+inline ThreadStats global_stats{{}, {}, {}, -1, 0, 0};
+inline std::mutex global_stats_mutex;
+
+/* Phase timing costs a few clock reads per include, so it is only done when
+ * requested. Counters are always kept. */
+inline bool stats_enabled = false;
+
+inline void count(Stat s, uint64_t n = 1) { thread_stats.stats[int(s)] += n; }
+
+inline void flush_thread_stats() {
+  std::lock_guard<std::mutex> lock(global_stats_mutex);
+  for (int i = 0; i < int(Stat::NUM_STATS); ++i) {
+    global_stats.stats[i] += thread_stats.stats[i];
+    thread_stats.stats[i] = 0;
+  }
+  for (int i = 0; i < int(Phase::NUM_PHASES); ++i) {
+    global_stats.wall_ns[i] += thread_stats.wall_ns[i];
+    global_stats.cpu_ns[i] += thread_stats.cpu_ns[i];
+    thread_stats.wall_ns[i] = 0;
+    thread_stats.cpu_ns[i] = 0;
+  }
+}
+
+inline int64_t wall_clock_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+inline int64_t thread_cpu_ns() {
+#ifdef SFINCLUDES_HAVE_RUSAGE
+  timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#else
+  return 0;
+#endif
+}
+
+/* Attributes the time until it goes out of scope to the given phase of the
+ * calling thread, pausing the enclosing phase (if any). */
+class PhaseTimer {
+public:
+  explicit PhaseTimer(Phase phase) {
+    if (!stats_enabled) {
+      return;
+    }
+    active_ = true;
+    previous_ = switch_to(int(phase));
+  }
+  ~PhaseTimer() {
+    if (active_) {
+      switch_to(previous_);
+    }
+  }
+  PhaseTimer(const PhaseTimer &) = delete;
+  PhaseTimer &operator=(const PhaseTimer &) = delete;
+
+private:
+  static int switch_to(int phase) {
+    ThreadStats &ts = thread_stats;
+    int64_t wall = wall_clock_ns();
+    int64_t cpu = thread_cpu_ns();
+    int previous = ts.current_phase;
+    if (previous >= 0) {
+      ts.wall_ns[previous] += wall - ts.last_wall_ns;
+      ts.cpu_ns[previous] += cpu - ts.last_cpu_ns;
+    }
+    ts.current_phase = phase;
+    ts.last_wall_ns = wall;
+    ts.last_cpu_ns = cpu;
+    return previous;
+  }
+
+  bool active_{false};
+  int previous_{-1};
+};
+
+/* The count of a stat over all threads, as far as they handed it over. */
+inline uint64_t stat_total(Stat s) {
+  flush_thread_stats();
+  return global_stats.stats[int(s)];
+}
+
+/* Whole-process numbers. */
+struct ProcessStats {
+  double wall_s{0};
+  double cpu_s{0};
+  long peak_rss_kb{0};
+};
+
+inline ProcessStats process_stats(int64_t start_wall_ns) {
+  ProcessStats ps;
+  ps.wall_s = (wall_clock_ns() - start_wall_ns) * 1e-9;
+#ifdef SFINCLUDES_HAVE_RUSAGE
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  ps.cpu_s = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+             (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e-6;
+#ifdef __APPLE__
+  ps.peak_rss_kb = usage.ru_maxrss / 1024; // bytes on macOS
+#else
+  ps.peak_rss_kb = usage.ru_maxrss;
+#endif
+#endif
+  return ps;
+}
+
+/* Phase times are summed over all threads, so with --jobs they can add up to
+ * more than the elapsed time. */
+inline void print_stats(std::ostream &out, const ProcessStats &ps) {
+  flush_thread_stats();
+  const ThreadStats &s = global_stats;
+  out << "[Stats]" << std::endl;
+  out << "Elapsed      : " << ps.wall_s << " s wall, " << ps.cpu_s
+      << " s cpu, peak RSS " << ps.peak_rss_kb << " kB" << std::endl;
+  for (int i = 0; i < int(Phase::NUM_PHASES); ++i) {
+    out << "  phase " << phase_name(Phase(i)) << ": " << s.wall_ns[i] * 1e-9
+        << " s wall, " << s.cpu_ns[i] * 1e-9 << " s cpu" << std::endl;
+  }
+  for (int i = 0; i < int(Stat::NUM_STATS); ++i) {
+    out << "  " << stat_name(Stat(i)) << ": " << s.stats[i] << std::endl;
+  }
+  uint64_t includes = s.stats[int(Stat::Includes)];
+  if (includes > 0) {
+    out << "  candidates_per_include: "
+        << double(s.stats[int(Stat::Candidates)]) / includes << std::endl;
+  }
+}
+
+inline void print_stats_json(std::ostream &out, const ProcessStats &ps) {
+  flush_thread_stats();
+  const ThreadStats &s = global_stats;
+  out << "{\"wall_s\": " << ps.wall_s << ", \"cpu_s\": " << ps.cpu_s
+      << ", \"peak_rss_kb\": " << ps.peak_rss_kb << ", \"phases\": {";
+  for (int i = 0; i < int(Phase::NUM_PHASES); ++i) {
+    out << (i ? ", " : "") << "\"" << phase_name(Phase(i))
+        << "\": {\"wall_s\": " << s.wall_ns[i] * 1e-9
+        << ", \"cpu_s\": " << s.cpu_ns[i] * 1e-9 << "}";
+  }
+  out << "}, \"counters\": {";
+  for (int i = 0; i < int(Stat::NUM_STATS); ++i) {
+    out << (i ? ", " : "") << "\"" << stat_name(Stat(i))
+        << "\": " << s.stats[i];
+  }
+  uint64_t includes = s.stats[int(Stat::Includes)];
+  out << "}, \"candidates_per_include\": "
+      << (includes > 0 ? double(s.stats[int(Stat::Candidates)]) / includes : 0)
+      << "}" << std::endl;
+}
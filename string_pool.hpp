@@ -0,0 +1,83 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+/* Append-only storage for strings, in large blocks that are never moved or
+ * freed before the arena itself: the views it hands out stay valid. Saves the
+ * allocation and the header of a std::string per string. */
+class StringArena {
+public:
+  std::string_view store(std::string_view s) {
+    if (blocks_.empty() || s.size() > capacity_ - used_) {
+      // Oversized strings get a block of their own.
+      capacity_ = std::max(s.size(), BLOCK_SIZE);
+      blocks_.push_back(std::make_unique<char[]>(capacity_));
+      bytes_ += capacity_;
+      used_ = 0;
+    }
+    char *p = blocks_.back().get() + used_;
+    std::memcpy(p, s.data(), s.size());
+    used_ += s.size();
+    return {p, s.size()};
+  }
+
+  size_t memory_usage() const {
+    return bytes_ + blocks_.capacity() * sizeof(blocks_[0]);
+  }
+
+private:
+  static constexpr size_t BLOCK_SIZE = 64 * 1024;
+
+  std::vector<std::unique_ptr<char[]>> blocks_;
+  size_t capacity_{0}; // of the last block
+  size_t used_{0};
+  size_t bytes_{0};
+};
+
+/* Interns strings into an arena. Ids are dense, in order of first appearance.
+ * Lookups are read-only and can be done from multiple threads. */
+class StringPool {
+public:
+  static constexpr uint32_t NOT_FOUND = UINT32_MAX;
+
+  uint32_t intern(std::string_view s) {
+    auto it = ids_.find(s);
+    if (it != ids_.end()) {
+      return it->second;
+    }
+    uint32_t id = views_.size();
+    views_.push_back(arena_.store(s));
+    ids_.emplace(views_.back(), id);
+    return id;
+  }
+
+  uint32_t find(std::string_view s) const {
+    auto it = ids_.find(s);
+    return it != ids_.end() ? it->second : NOT_FOUND;
+  }
+
+  std::string_view operator[](uint32_t id) const { return views_[id]; }
+  size_t size() const { return views_.size(); }
+
+  /* Stores a string that is not interned, next to the last interned one. */
+  std::string_view store(std::string_view s) { return arena_.store(s); }
+
+  /* Approximately, as the hash table nodes are not accounted exactly. */
+  size_t memory_usage() const {
+    return arena_.memory_usage() + views_.capacity() * sizeof(views_[0]) +
+           ids_.bucket_count() * sizeof(void *) +
+           ids_.size() * (sizeof(void *) + sizeof(size_t) +
+                          sizeof(std::pair<std::string_view, uint32_t>));
+  }
+
+private:
+  StringArena arena_;
+  std::vector<std::string_view> views_;
+  std::unordered_map<std::string_view, uint32_t> ids_;
+};
@@ -0,0 +1,490 @@
+#pragma once
+
+#include <algorithm>
+#include <bitset>
+#include <fstream>
+#include <iterator>
+#include <numeric>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#include "sfincludes.hpp"
+#include "stats.hpp"
+
+/* A pattern as in .gitignore, compiled once into tokens:
+ *
+ *  - '*' and '?' match within a path component, "**" across components, and
+ *    "**" followed by '/' any number of leading directories, none included;
+ *  - [abc], [a-z] and [!a-z] match a character of a class;
+ *  - a leading '!' re-includes what an earlier pattern ignored;
+ *  - a trailing '/' only matches directories;
+ *  - a pattern with a '/' elsewhere matches the path relative to the
+ *    directory of its .gitignore file, others match the name alone. */
+class GlobPattern {
+public:
+  explicit GlobPattern(std::string_view pattern) {
+    if (!pattern.empty() && pattern[0] == '!') {
+      negated_ = true;
+      pattern.remove_prefix(1);
+    }
+    if (!pattern.empty() && pattern.back() == '/') {
+      directory_only_ = true;
+      pattern.remove_suffix(1);
+    }
+    if (pattern.find('/') != std::string_view::npos) {
+      anchored_ = true;
+      if (pattern[0] == '/') {
+        pattern.remove_prefix(1);
+      }
+    }
+    compile(pattern);
+  }
+
+  bool negated() const { return negated_; }
+  bool anchored() const { return anchored_; }
+
+  /* relative is the '/' separated path from the directory of the pattern. */
+  bool matches(std::string_view relative, bool is_dir) const {
+    if (directory_only_ && !is_dir) {
+      return false;
+    }
+    std::string_view subject = relative;
+    if (!anchored_) {
+      size_t slash = relative.rfind('/');
+      if (slash != std::string_view::npos) {
+        subject.remove_prefix(slash + 1);
+      }
+    }
+    return match(0, subject.data(), subject.data() + subject.size());
+  }
+
+private:
+  enum class Kind { Literal, Any, Class, Star, AnyPath, Directories };
+  struct Token {
+    Kind kind;
+    std::string literal{};
+    std::bitset<256> chars{};
+  };
+
+  void compile(std::string_view p) {
+    for (size_t i = 0; i < p.size(); ++i) {
+      char c = p[i];
+      if (c == '*' && i + 1 < p.size() && p[i + 1] == '*') {
+        i++;
+        if (i + 1 < p.size() && p[i + 1] == '/') {
+          i++;
+          tokens_.push_back({Kind::Directories});
+        } else {
+          tokens_.push_back({Kind::AnyPath});
+        }
+      } else if (c == '*') {
+        tokens_.push_back({Kind::Star});
+      } else if (c == '?') {
+        tokens_.push_back({Kind::Any});
+      } else if (c == '[' && p.find(']', i + 2) != std::string_view::npos) {
+        Token token{Kind::Class};
+        size_t j = i + 1;
+        bool negate = p[j] == '!' || p[j] == '^';
+        if (negate) {
+          j++;
+        }
+        // A ']' right after the opening bracket is a literal.
+        for (size_t first = j; j < p.size() && (p[j] != ']' || j == first);
+             ++j) {
+          if (j + 2 < p.size() && p[j + 1] == '-' && p[j + 2] != ']') {
+            for (int ch = (unsigned char)p[j]; ch <= (unsigned char)p[j + 2];
+                 ++ch) {
+              token.chars.set(ch);
+            }
+            j += 2;
+          } else {
+            token.chars.set((unsigned char)p[j]);
+          }
+        }
+        if (negate) {
+          token.chars.flip();
+        }
+        token.chars.reset('/');
+        tokens_.push_back(std::move(token));
+        i = j;
+      } else {
+        if (c == '\\' && i + 1 < p.size()) {
+          c = p[++i];
+        }
+        if (tokens_.empty() || tokens_.back().kind != Kind::Literal) {
+          tokens_.push_back({Kind::Literal});
+        }
+        tokens_.back().literal += c;
+      }
+    }
+  }
+
+  bool match(size_t t, const char *s, const char *end) const {
+    for (; t < tokens_.size(); ++t) {
+      const Token &token = tokens_[t];
+      switch (token.kind) {
+      case Kind::Literal:
+        if (size_t(end - s) < token.literal.size() ||
+            token.literal.compare(0, std::string::npos, s,
+                                  token.literal.size()) != 0) {
+          return false;
+        }
+        s += token.literal.size();
+        break;
+      case Kind::Any:
+        if (s == end || *s == '/') {
+          return false;
+        }
+        s++;
+        break;
+      case Kind::Class:
+        if (s == end || !token.chars.test((unsigned char)*s)) {
+          return false;
+        }
+        s++;
+        break;
+      case Kind::Star:
+        for (;; ++s) {
+          if (match(t + 1, s, end)) {
+            return true;
+          }
+          if (s == end || *s == '/') {
+            return false;
+          }
+        }
+      case Kind::AnyPath:
+        for (;; ++s) {
+          if (match(t + 1, s, end)) {
+            return true;
+          }
+          if (s == end) {
+            return false;
+          }
+        }
+      case Kind::Directories:
+        if (match(t + 1, s, end)) {
+          return true;
+        }
+        for (; s != end; ++s) {
+          if (*s == '/' && match(t + 1, s + 1, end)) {
+            return true;
+          }
+        }
+        return false;
+      }
+    }
+    return s == end;
+  }
+
+  std::vector<Token> tokens_;
+  bool negated_{false};
+  bool directory_only_{false};
+  bool anchored_{false};
+};
+
+/* Decides which entries under a root directory a walk skips: those ignored
+ * by the .gitignore files of the directories entered so far (and of the
+ * directories above the root, up to the top of its git work tree), those
+ * matching one of Options::exclude, and version control directories. The
+ * last matching pattern decides, and --exclude patterns come last. Paths
+ * are '/' separated and relative to the root. */
+class IgnoreStack {
+public:
+  IgnoreStack(const Options &options, const fs::path &root)
+      : gitignore_(options.gitignore) {
+    for (const std::string &pattern : options.exclude) {
+      excludes_.emplace_back(pattern);
+    }
+    if (!gitignore_) {
+      return;
+    }
+    /* The .gitignore files above the root apply to it as well, up to the
+     * top of the work tree. Outside of one, there is no such top. */
+    std::error_code ec;
+    fs::path dir = fs::absolute(root, ec).lexically_normal();
+    if (!dir.has_filename()) {
+      dir = dir.parent_path();
+    }
+    std::string prefix; // of the root, relative to dir
+    while (!fs::exists(dir / ".git", ec)) {
+      if (!dir.has_relative_path()) {
+        levels_.clear();
+        break;
+      }
+      prefix = dir.filename().string() + "/" + prefix;
+      dir = dir.parent_path();
+      std::vector<GlobPattern> patterns = load(dir / ".gitignore");
+      if (!patterns.empty()) {
+        levels_.insert(levels_.begin(), Level{0, prefix, 0, patterns});
+      }
+    }
+    enter(root, "", 0);
+  }
+
+  /* Starts applying the .gitignore in dir, which is at relative from the
+   * root and depth levels below it, until leave() to a smaller depth.
+   * Nothing is read when the caller knows there is no .gitignore. */
+  void enter(const fs::path &dir, const std::string &relative, int depth,
+             bool may_have_gitignore = true) {
+    if (!gitignore_ || !may_have_gitignore) {
+      return;
+    }
+    std::vector<GlobPattern> patterns = load(dir / ".gitignore");
+    if (!patterns.empty()) {
+      size_t strip = relative.empty() ? 0 : relative.size() + 1;
+      levels_.push_back({depth, "", strip, std::move(patterns)});
+    }
+  }
+
+  void leave(int depth) {
+    while (!levels_.empty() && levels_.back().depth > depth) {
+      levels_.pop_back();
+    }
+  }
+
+  bool ignored(std::string_view relative, bool is_dir) const {
+    std::string_view name = relative.substr(relative.rfind('/') + 1);
+    if (is_dir && (name == ".git" || name == ".hg" || name == ".svn")) {
+      return true;
+    }
+    bool ignored = false;
+    std::string prefixed;
+    for (const Level &level : levels_) {
+      std::string_view path = relative.substr(level.strip);
+      if (!level.prefix.empty()) {
+        prefixed = level.prefix;
+        prefixed += path;
+        path = prefixed;
+      }
+      for (const GlobPattern &pattern : level.patterns) {
+        if (pattern.matches(path, is_dir)) {
+          ignored = !pattern.negated();
+        }
+      }
+    }
+    for (const GlobPattern &pattern : excludes_) {
+      if (pattern.matches(relative, is_dir)) {
+        ignored = !pattern.negated();
+      }
+    }
+    return ignored;
+  }
+
+private:
+  struct Level {
+    int depth;
+    std::string prefix; // of the paths relative to the .gitignore directory
+    size_t strip;       // characters of the path relative to the root
+    std::vector<GlobPattern> patterns;
+  };
+
+  static std::vector<GlobPattern> load(const fs::path &file) {
+    std::vector<GlobPattern> patterns;
+    std::ifstream in(file, std::ios::binary);
+    std::string line;
+    while (std::getline(in, line)) {
+      if (!line.empty() && line.back() == '\r') {
+        line.pop_back();
+      }
+      while (!line.empty() && line.back() == ' ' &&
+             (line.size() < 2 || line[line.size() - 2] != '\\')) {
+        line.pop_back();
+      }
+      if (!line.empty() && line[0] != '#') {
+        patterns.emplace_back(line);
+      }
+    }
+    return patterns;
+  }
+
+  bool gitignore_;
+  std::vector<Level> levels_;
+  std::vector<GlobPattern> excludes_;
+};
+
+/* Calls on_file(path) for every wanted file under root that is not ignored
+ * (see IgnoreStack), in directory order, and on_dir(path) for every
+ * directory below root that is entered. Ignored directories are not
+ * entered. Directory symlinks are followed up to Options::follow_symlinks
+ * deep, which also bounds symlink loops. Ignored directories and wanted
+ * files are counted as Stat::SkippedDirectories and Stat::SkippedFiles. */
+template <typename W, typename F, typename D>
+void walk_tree(const fs::path &root, const Options &options, W wanted,
+               F on_file, D on_dir) {
+  IgnoreStack ignore(options, root);
+  /* Entries are root / relative: the relative path is a suffix. */
+  size_t root_length = (root / "").native().size();
+  auto flags = options.follow_symlinks > 0
+                   ? fs::directory_options::follow_directory_symlink
+                   : fs::directory_options::none;
+  std::vector<int> symlinks{0}; // followed on the way to each depth
+  std::string relative;
+  for (fs::recursive_directory_iterator it(root, flags), end; it != end;
+       ++it) {
+    int depth = it.depth();
+    ignore.leave(depth);
+    symlinks.resize(depth + 1);
+    bool is_dir = it->is_directory();
+    if (!is_dir && !wanted(it->path())) {
+      continue;
+    }
+    relative.assign(it->path().native(), root_length);
+    if (fs::path::preferred_separator != '/') {
+      std::replace(relative.begin(), relative.end(),
+                   char(fs::path::preferred_separator), '/');
+    }
+    if (ignore.ignored(relative, is_dir)) {
+      count(is_dir ? Stat::SkippedDirectories : Stat::SkippedFiles);
+      if (is_dir) {
+        it.disable_recursion_pending();
+      }
+      continue;
+    }
+    if (!is_dir) {
+      on_file(it->path());
+      continue;
+    }
+    int followed = symlinks[depth] + (it->is_symlink() ? 1 : 0);
+    if (followed > options.follow_symlinks) {
+      it.disable_recursion_pending(); // Not counted: as without following.
+      continue;
+    }
+    symlinks.push_back(followed);
+    ignore.enter(it->path(), relative, depth + 1);
+    on_dir(it->path());
+  }
+}
+
+template <typename W, typename F>
+void walk_tree(const fs::path &root, const Options &options, W wanted,
+               F on_file) {
+  walk_tree(root, options, wanted, on_file, [](const fs::path &) {});
+}
+
+/* Whether walk_tree(root) enters the directory at relative, a '/' separated
+ * path below root. */
+inline bool walk_enters(const fs::path &root, const fs::path &relative,
+                        const Options &options) {
+  IgnoreStack ignore(options, root);
+  fs::path dir = root;
+  std::string path;
+  int depth = 0;
+  for (const fs::path &name : relative) {
+    dir /= name;
+    path += (path.empty() ? "" : "/") + name.string();
+    std::error_code ec;
+    bool is_dir = fs::is_directory(dir, ec);
+    if (!is_dir || ignore.ignored(path, true) ||
+        (fs::is_symlink(dir, ec) && options.follow_symlinks == 0)) {
+      return false;
+    }
+    ignore.enter(dir, path, ++depth);
+  }
+  return true;
+}
+
+/* A directory for walk_trees(), and the files it lists. */
+struct WalkRoot {
+  fs::path path;
+  bool (*wanted)(const fs::path &);
+};
+
+/* The wanted files under every root, as walk_tree() finds them, walking the
+ * directories shared by nested or repeated roots once: a root below another
+ * one that is walked, and whose walk enters it, takes its files from that
+ * walk. The .gitignore files between both roots then apply to it as they do
+ * to the enclosing root. Anchored --exclude patterns are relative to the root
+ * walked, and followed symlinks count from it, so with either every root is
+ * walked on its own. Paths are root / relative, as the root is spelled. */
+inline std::vector<std::vector<std::string>>
+walk_trees(const std::vector<WalkRoot> &roots, const Options &options) {
+  std::vector<std::vector<std::string>> files(roots.size());
+  bool shared = options.follow_symlinks == 0 &&
+                std::none_of(options.exclude.begin(), options.exclude.end(),
+                             [](const std::string &pattern) {
+                               return GlobPattern(pattern).anchored();
+                             });
+  std::vector<fs::path> normal;
+  for (const WalkRoot &root : roots) {
+    std::error_code ec;
+    fs::path path = fs::absolute(root.path, ec).lexically_normal();
+    normal.push_back(path.has_filename() ? path : path.parent_path());
+  }
+  /* Outer roots first, so that the walk of every enclosing root is known:
+   * walked[i] is the root whose walk lists the files of root i. */
+  std::vector<size_t> order(roots.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return std::distance(normal[a].begin(), normal[a].end()) <
+           std::distance(normal[b].begin(), normal[b].end());
+  });
+  std::vector<size_t> walked(roots.size());
+  std::vector<fs::path> below(roots.size()); // relative to the root walked
+  for (size_t n = 0; n < order.size(); ++n) {
+    size_t i = order[n];
+    walked[i] = i;
+    for (size_t m = 0; shared && m < n; ++m) {
+      size_t outer = order[m];
+      fs::path relative = normal[i].lexically_relative(normal[outer]);
+      if (walked[outer] == outer && !relative.empty() &&
+          *relative.begin() != ".." &&
+          (relative == "." || walk_enters(roots[outer].path, relative,
+                                          options))) {
+        walked[i] = outer;
+        below[i] = relative == "." ? fs::path() : relative;
+        break;
+      }
+    }
+  }
+
+  for (size_t w = 0; w < roots.size(); ++w) {
+    if (walked[w] != w) {
+      continue;
+    }
+    /* The roots listed by this walk, with the prefix of their files in the
+     * paths relative to it, and how they spell it. */
+    struct Listed {
+      size_t root;
+      std::string prefix;
+      std::string spelled;
+    };
+    std::vector<Listed> listed;
+    for (size_t i = 0; i < roots.size(); ++i) {
+      if (walked[i] == w) {
+        std::string prefix = below[i].generic_string();
+        listed.push_back({i, prefix.empty() ? prefix : prefix + "/",
+                          (roots[i].path / "").native()});
+      }
+    }
+    size_t root_length = (roots[w].path / "").native().size();
+    std::string relative;
+    walk_tree(
+        roots[w].path, options,
+        [&](const fs::path &file) {
+          for (const Listed &l : listed) {
+            if (roots[l.root].wanted(file)) {
+              return true;
+            }
+          }
+          return false;
+        },
+        [&](const fs::path &file) {
+          relative.assign(file.native(), root_length);
+          if (fs::path::preferred_separator != '/') {
+            std::replace(relative.begin(), relative.end(),
+                         char(fs::path::preferred_separator), '/');
+          }
+          for (const Listed &l : listed) {
+            if (relative.compare(0, l.prefix.size(), l.prefix) == 0 &&
+                roots[l.root].wanted(file)) {
+              files[l.root].push_back(
+                  l.spelled + file.native().substr(root_length +
+                                                   l.prefix.size()));
+            }
+          }
+        });
+  }
+  return files;
+}
@@ -0,0 +1,375 @@
+#pragma once
+
+#include <algorithm>
+#include <iterator>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define SFINCLUDES_HAVE_DIRENT 1
+#endif
+
+#include "sfincludes.hpp"
+#include "stats.hpp"
+
+enum class VfsType { File, Directory, Symlink };
+
+/* An entry of a directory listing. Symlinks are not followed. */
+struct VfsEntry {
+  std::string name;
+  VfsType type{VfsType::File};
+};
+
+/* The filesystem queries of indexing and resolution, so that they can be
+ * answered without going to the disk every time. All member functions are
+ * safe to call from several threads at once. */
+class Vfs {
+public:
+  virtual ~Vfs() = default;
+
+  /* Whether path exists, following symlinks. */
+  virtual bool exists(const fs::path &path) const = 0;
+  virtual bool is_directory(const fs::path &path) const = 0;
+  /* Whether path itself is a symlink. */
+  virtual bool is_symlink(const fs::path &path) const = 0;
+  /* The entries of the directory at path, by name; none if it is not one. */
+  virtual std::vector<VfsEntry> list(const fs::path &path) const = 0;
+  /* Same as fs::weakly_canonical(path). */
+  virtual fs::path weakly_canonical(const fs::path &path) const = 0;
+
+  /* Same as fs::relative(path, base). */
+  fs::path relative(const fs::path &path, const fs::path &base) const {
+    return weakly_canonical(path).lexically_relative(weakly_canonical(base));
+  }
+};
+
+/* Every query is a system call. */
+class DiskVfs : public Vfs {
+public:
+  bool exists(const fs::path &path) const override {
+    std::error_code ec;
+    return fs::exists(path, ec);
+  }
+
+  bool is_directory(const fs::path &path) const override {
+    std::error_code ec;
+    return fs::is_directory(path, ec);
+  }
+
+  bool is_symlink(const fs::path &path) const override {
+    std::error_code ec;
+    return fs::is_symlink(path, ec);
+  }
+
+  std::vector<VfsEntry> list(const fs::path &path) const override {
+    std::vector<VfsEntry> entries;
+    std::error_code ec;
+    for (fs::directory_iterator it(path, ec), end; !ec && it != end;
+         it.increment(ec)) {
+      entries.push_back({it->path().filename().native(), type_of(*it)});
+    }
+    std::sort(entries.begin(), entries.end(),
+              [](const VfsEntry &a, const VfsEntry &b) {
+                return a.name < b.name;
+              });
+    return entries;
+  }
+
+  fs::path weakly_canonical(const fs::path &path) const override {
+    return fs::weakly_canonical(path);
+  }
+
+  static VfsType type_of(const fs::directory_entry &entry) {
+    std::error_code ec;
+    fs::file_status status = entry.symlink_status(ec);
+    if (fs::is_symlink(status)) {
+      return VfsType::Symlink;
+    }
+    return fs::is_directory(status) ? VfsType::Directory : VfsType::File;
+  }
+};
+
+inline const Vfs &disk_vfs() {
+  static const DiskVfs vfs;
+  return vfs;
+}
+
+/* A tree that only exists in memory, for benchmarks and tests. It is built
+ * with add_file(), add_directory() and add_symlink() before it is queried;
+ * relative paths are taken relative to cwd. Paths are resolved the way the
+ * kernel does: symlinks are followed, also before "..". */
+class MemoryVfs : public Vfs {
+public:
+  /* cwd must be absolute. */
+  explicit MemoryVfs(fs::path cwd = "/") : cwd_(std::move(cwd)) {}
+
+  /* Adds the missing parent directories too. */
+  void add_file(const fs::path &path) { add(path, {VfsType::File, {}}); }
+  void add_directory(const fs::path &path) {
+    add(path, {VfsType::Directory, {}});
+  }
+  void add_symlink(const fs::path &path, fs::path target) {
+    add(path, {VfsType::Symlink, std::move(target)});
+  }
+
+  bool exists(const fs::path &path) const override {
+    return resolve(absolute(path)).found;
+  }
+
+  bool is_directory(const fs::path &path) const override {
+    Resolved r = resolve(absolute(path));
+    return r.found && r.type == VfsType::Directory;
+  }
+
+  bool is_symlink(const fs::path &path) const override {
+    const std::string &full = absolute(path);
+    size_t slash = full.rfind('/');
+    std::string_view name = std::string_view(full).substr(slash + 1);
+    if (name.empty() || name == "." || name == "..") {
+      return false;
+    }
+    Resolved parent = resolve(full.substr(0, slash));
+    if (!parent.found || parent.type != VfsType::Directory) {
+      return false;
+    }
+    const Entry *e = entry(parent.path, name);
+    return e && e->type == VfsType::Symlink;
+  }
+
+  std::vector<VfsEntry> list(const fs::path &path) const override {
+    std::vector<VfsEntry> entries;
+    Resolved r = resolve(absolute(path));
+    if (r.found && r.type == VfsType::Directory) {
+      if (const Directory *dir = directory(r.path)) {
+        for (const auto &[name, e] : *dir) {
+          entries.push_back({name, e.type});
+        }
+      }
+    }
+    return entries;
+  }
+
+  /* As libstdc++ does, a relative path of which not even the first
+   * component exists stays relative. A symlink loop does not throw, but is
+   * taken to be missing. */
+  fs::path weakly_canonical(const fs::path &path) const override {
+    if (path.is_relative() && !path.empty() &&
+        !resolve(absolute(*path.begin())).found) {
+      return path.lexically_normal();
+    }
+    Resolved r = resolve(absolute(path));
+    if (r.found) {
+      return r.path;
+    }
+    return (fs::path(r.path) / r.rest).lexically_normal();
+  }
+
+protected:
+  struct Entry {
+    VfsType type{VfsType::File};
+    fs::path target{}; // of a symlink, as it was written
+  };
+  /* Sorted by name. */
+  using Directory = std::vector<std::pair<std::string, Entry>>;
+
+  static Directory::const_iterator lower_bound(const Directory &listing,
+                                               std::string_view name) {
+    return std::lower_bound(
+        listing.begin(), listing.end(), name,
+        [](const auto &e, std::string_view name) { return e.first < name; });
+  }
+
+  /* The listing of a directory by its canonical path, or nullptr if there is
+   * no such directory. */
+  virtual const Directory *directory(const std::string &path) const {
+    static const Directory empty_root;
+    auto it = directories_.find(path);
+    if (it != directories_.end()) {
+      return &it->second;
+    }
+    return path == "/" ? &empty_root : nullptr;
+  }
+
+  std::string absolute(const fs::path &path) const {
+    return path.is_absolute() ? path.native() : (cwd_ / path).native();
+  }
+
+  fs::path cwd_;
+  /* A listing of SnapshotVfs is never changed once it is in here, so that
+   * it can be read without holding a lock. */
+  mutable std::unordered_map<std::string, Directory> directories_;
+
+private:
+  /* How far a path resolves: the canonical path of the part of it that
+   * exists, and the rest. Plain strings, split at '/': resolving is done for
+   * every file processed, and a fs::path allocates its components. */
+  struct Resolved {
+    std::string path;
+    std::string rest{};
+    VfsType type{VfsType::Directory};
+    bool found{true};
+  };
+
+  /* Same as the kernel's limit. */
+  static constexpr int MAX_SYMLINKS = 40;
+
+  const Entry *entry(const std::string &dir, std::string_view name) const {
+    const Directory *listing = directory(dir);
+    if (!listing) {
+      return nullptr;
+    }
+    auto it = lower_bound(*listing, name);
+    return it != listing->end() && it->first == name ? &it->second : nullptr;
+  }
+
+  /* Resolves an absolute path. A symlink only counts as existing if its
+   * target does, as with stat(). */
+  Resolved resolve(const std::string &full, int symlinks = 0) const {
+    Resolved r{"/"};
+    for (size_t begin = 1, end; begin <= full.size(); begin = end + 1) {
+      end = std::min(full.find('/', begin), full.size());
+      std::string_view name = std::string_view(full).substr(begin, end - begin);
+      if (name.empty() && r.type == VfsType::Directory) {
+        continue;
+      }
+      const Entry *e = nullptr;
+      if (r.type == VfsType::Directory) {
+        if (name == ".") {
+          continue;
+        } else if (name == "..") {
+          r.path.resize(std::max<size_t>(r.path.rfind('/'), 1));
+          continue;
+        }
+        e = entry(r.path, name);
+      }
+      Resolved target{{}, {}, VfsType::File, false};
+      if (e && e->type == VfsType::Symlink) {
+        if (++symlinks <= MAX_SYMLINKS) {
+          target = resolve(absolute(fs::path(r.path) / e->target), symlinks);
+        }
+        e = target.found ? e : nullptr;
+      }
+      if (!e) {
+        r.found = false;
+        r.rest = full.substr(begin);
+        break;
+      }
+      if (e->type == VfsType::Symlink) {
+        r.path = std::move(target.path);
+        r.type = target.type;
+      } else {
+        if (r.path.size() > 1) {
+          r.path += '/';
+        }
+        r.path += name;
+        r.type = e->type;
+      }
+    }
+    return r;
+  }
+
+  void add(const fs::path &path, Entry entry) {
+    fs::path full = fs::path(absolute(path)).lexically_normal();
+    if (!full.has_filename()) {
+      full = full.parent_path();
+    }
+    if (full != full.root_path()) {
+      add_directory(full.parent_path());
+      Directory &parent = directories_[full.parent_path().native()];
+      std::string name = full.filename().native();
+      auto it = parent.begin() + (lower_bound(parent, name) - parent.begin());
+      if (it != parent.end() && it->first == name) {
+        it->second = entry;
+      } else {
+        parent.insert(it, {std::move(name), entry});
+      }
+    }
+    if (entry.type == VfsType::Directory) {
+      directories_[full.native()];
+    }
+  }
+};
+
+/* The disk as it was: each directory is listed once, the first time it is
+ * looked into, and all queries about it are answered from memory after. A
+ * directory that cannot be listed is taken to be empty. Changes made to the
+ * disk after that are not seen. */
+class SnapshotVfs : public MemoryVfs {
+public:
+  SnapshotVfs() : MemoryVfs(fs::current_path()) {}
+
+protected:
+  const Directory *directory(const std::string &path) const override {
+    {
+      std::shared_lock<std::shared_mutex> lock(mutex_);
+      auto it = directories_.find(path);
+      if (it != directories_.end()) {
+        return &it->second;
+      }
+    }
+    Directory listing = read_directory(path);
+    std::sort(listing.begin(), listing.end(),
+              [](const auto &a, const auto &b) { return a.first < b.first; });
+    count(Stat::DirectoriesListed);
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    return &directories_.emplace(path, std::move(listing)).first->second;
+  }
+
+private:
+  /* With readdir(), the type of most entries comes with the listing, and
+   * no path is built for them. */
+  static Directory read_directory(const std::string &path) {
+    Directory listing;
+#ifdef SFINCLUDES_HAVE_DIRENT
+    DIR *dir = ::opendir(path.c_str());
+    if (!dir) {
+      return listing;
+    }
+    while (const dirent *d = ::readdir(dir)) {
+      std::string_view name = d->d_name;
+      if (name == "." || name == "..") {
+        continue;
+      }
+      std::string full = path + (path.back() == '/' ? "" : "/");
+      full += name;
+      Entry e;
+      unsigned char type = d->d_type;
+      struct stat st;
+      if (type == DT_UNKNOWN && ::lstat(full.c_str(), &st) == 0) {
+        type = S_ISLNK(st.st_mode) ? DT_LNK : S_ISDIR(st.st_mode) ? DT_DIR : 0;
+      }
+      if (type == DT_LNK) {
+        e.type = VfsType::Symlink;
+        std::error_code ec;
+        e.target = fs::read_symlink(full, ec);
+      } else if (type == DT_DIR) {
+        e.type = VfsType::Directory;
+      }
+      listing.emplace_back(name, std::move(e));
+    }
+    ::closedir(dir);
+#else
+    std::error_code ec;
+    for (fs::directory_iterator it(path, ec), end; !ec && it != end;
+         it.increment(ec)) {
+      Entry e{DiskVfs::type_of(*it)};
+      if (e.type == VfsType::Symlink) {
+        std::error_code link_ec;
+        e.target = fs::read_symlink(it->path(), link_ec);
+      }
+      listing.emplace_back(it->path().filename().native(), std::move(e));
+    }
+#endif
+    return listing;
+  }
+
+  mutable std::shared_mutex mutex_;
+};
@@ -0,0 +1,336 @@
+#pragma once
+
+#include <functional>
+#include <map>
+#include <ostream>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "resolver.hpp"
+#include "reverse_index.hpp"
+#include "sfincludes.hpp"
+#include "write_back.hpp"
+
+#if defined(__linux__)
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#define SFINCLUDES_HAVE_INOTIFY 1
+#endif
+
+#ifdef SFINCLUDES_HAVE_INOTIFY
+
+/* Keeps the header index of a resolver in sync with the include search
+ * paths, and re-fixes the source files that a header change can affect: the
+ * ones with an include of a created, removed or moved header's filename, as
+ * found in a reverse index of all includes. Source files that are moved in
+ * are fixed as well. Files that are only written are not fixed, but their
+ * includes are indexed again; this includes the files written by the watcher
+ * itself. */
+class Watcher {
+public:
+  Watcher(Resolver &resolver, std::vector<fs::path> source_dirs,
+          std::function<void(const FileReport &)> on_report, std::ostream &log)
+      : resolver_(resolver), source_dirs_(std::move(source_dirs)),
+        on_report_(std::move(on_report)), log_(log) {}
+
+  ~Watcher() {
+    if (fd_ >= 0) {
+      ::close(fd_);
+    }
+  }
+
+  /* Watches until an error occurs. Returns the exit code. */
+  int run() {
+    fd_ = ::inotify_init1(IN_CLOEXEC);
+    if (fd_ < 0) {
+      log_ << "Cannot initialize inotify." << std::endl;
+      return 1;
+    }
+    for (const IncludePath &inc : resolver_.include_paths()) {
+      watch_tree(inc.path);
+    }
+    for (const fs::path &dir : source_dirs_) {
+      for (const fs::path &file : watch_tree(dir)) {
+        if (has_source_extension(file)) {
+          users_.set(file, scan_includes(file, resolver_.options()));
+        }
+      }
+    }
+    log_ << "Watching " << dirs_.size() << " directories, "
+         << users_.num_files() << " source files." << std::endl;
+
+    for (;;) {
+      Batch batch;
+      /* Block until something happens, then collect events until it has been
+       * quiet for a moment: a move of many files arrives in pieces. */
+      int timeout = -1;
+      pollfd pfd{fd_, POLLIN, 0};
+      while (::poll(&pfd, 1, timeout) > 0) {
+        if (!read_events(batch)) {
+          return 1;
+        }
+        timeout = 20;
+      }
+      apply(batch);
+    }
+  }
+
+private:
+  static constexpr uint32_t MASK = IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                                   IN_MOVED_TO | IN_CLOSE_WRITE;
+
+  /* The changes of one round of events, applied at once. */
+  struct Batch {
+    std::vector<std::pair<bool, fs::path>> header_changes; // added?, path
+    std::set<std::string> removed_sources;
+    std::set<std::string> changed_sources; // to scan again
+    std::set<std::string> moved_sources;   // to fix
+    /* Of write-back temporary files moved away. inotify reports both halves
+     * of a move together, so a cookie left over at the end of the batch was
+     * a move out of the watched directories. */
+    std::set<uint32_t> written_cookies;
+  };
+
+  bool read_events(Batch &batch) {
+    alignas(inotify_event) char buffer[64 * 1024];
+    ssize_t n = ::read(fd_, buffer, sizeof(buffer));
+    if (n <= 0) {
+      log_ << "Reading inotify events failed." << std::endl;
+      return false;
+    }
+    for (char *p = buffer; p < buffer + n;) {
+      const inotify_event *event = reinterpret_cast<inotify_event *>(p);
+      p += sizeof(inotify_event) + event->len;
+      if (event->mask & IN_Q_OVERFLOW) {
+        log_ << RED << "Watch: events were lost, restart to index again."
+             << CLEAR << std::endl;
+        continue;
+      }
+      auto dir = dirs_.find(event->wd);
+      if (dir == dirs_.end() || event->len == 0) {
+        continue;
+      }
+      handle(batch, dir->second / event->name, event->mask, event->cookie);
+    }
+    return true;
+  }
+
+  void handle(Batch &batch, const fs::path &path, uint32_t mask,
+              uint32_t cookie) {
+    /* A file written back atomically is a temporary file moved over it:
+     * written, not moved in. */
+    if ((mask & IN_MOVED_FROM) && is_write_back_temp_path(path)) {
+      batch.written_cookies.insert(cookie);
+      return;
+    }
+    bool moved_in =
+        (mask & IN_MOVED_TO) && !batch.written_cookies.erase(cookie);
+    if (mask & IN_ISDIR) {
+      if (mask & (IN_CREATE | IN_MOVED_TO)) {
+        for (const fs::path &file : watch_tree(path)) {
+          added(batch, file, moved_in);
+        }
+      } else if (mask & (IN_DELETE | IN_MOVED_FROM)) {
+        unwatch_tree(path);
+        removed(batch, path, true);
+      }
+      return;
+    }
+    if (mask & (IN_CREATE | IN_MOVED_TO)) {
+      added(batch, path, moved_in);
+    } else if (mask & (IN_DELETE | IN_MOVED_FROM)) {
+      removed(batch, path, false);
+    } else if ((mask & IN_CLOSE_WRITE) && is_source(path)) {
+      batch.changed_sources.insert(path.string());
+    }
+  }
+
+  void added(Batch &batch, const fs::path &file, bool moved_in) {
+    if (is_header(file)) {
+      batch.header_changes.push_back({true, file});
+    }
+    if (is_source(file)) {
+      batch.removed_sources.erase(file.string());
+      batch.changed_sources.insert(file.string());
+      if (moved_in) {
+        batch.moved_sources.insert(file.string());
+      }
+    }
+  }
+
+  void removed(Batch &batch, const fs::path &path, bool is_dir) {
+    if (is_dir || is_header(path)) {
+      batch.header_changes.push_back({false, path});
+    }
+    if (is_dir || is_source(path)) {
+      batch.removed_sources.insert(path.string());
+    }
+  }
+
+  void apply(Batch &batch) {
+    std::set<std::string> filenames;
+    for (const auto &[is_added, path] : batch.header_changes) {
+      if (is_added) {
+        resolver_.add_header(path);
+        filenames.insert(path.filename().string());
+      } else {
+        for (std::string &filename : resolver_.remove_headers(path)) {
+          filenames.insert(std::move(filename));
+        }
+      }
+    }
+    for (const std::string &path : batch.removed_sources) {
+      users_.remove(path);
+    }
+    for (const std::string &file : batch.changed_sources) {
+      if (fs::is_regular_file(file)) {
+        users_.set(file, scan_includes(file, resolver_.options()));
+      }
+    }
+
+    std::set<std::string> affected = batch.moved_sources;
+    for (const std::string &filename : filenames) {
+      users_.find_users(filename, resolver_.options().fuzzy, affected);
+    }
+    ProcessResult result{};
+    for (const std::string &file : affected) {
+      if (fs::is_regular_file(file)) {
+        FileReport report;
+        resolver_.process_file(file, &result, &report);
+        on_report_(report);
+      }
+    }
+    if (!filenames.empty() || !affected.empty()) {
+      log_ << "Watch: " << filenames.size() << " header filenames changed, "
+           << affected.size() << " files fixed again (" << result.replaced_path
+           << " includes replaced, " << result.failed << " failed)."
+           << std::endl;
+    }
+  }
+
+  /* Starts watching dir and the directories under it that indexing and
+   * processing enter (see walk_tree()), unless dir itself is one they skip.
+   * Returns the headers and source files found in them. */
+  std::vector<fs::path> watch_tree(const fs::path &dir) {
+    std::vector<fs::path> files;
+    const fs::path *root = root_of(dir);
+    if (!root || (dir != *root &&
+                  !walk_enters(*root, dir.lexically_relative(*root),
+                               resolver_.options()))) {
+      return files;
+    }
+    watch_dir(dir);
+    try {
+      walk_tree(
+          dir, resolver_.options(),
+          [](const fs::path &file) {
+            return has_header_extension(file) || has_source_extension(file);
+          },
+          [&](const fs::path &file) { files.push_back(file); },
+          [&](const fs::path &sub) { watch_dir(sub); });
+    } catch (const fs::filesystem_error &) {
+      // Removed while walking it: the events of the removal follow.
+    }
+    return files;
+  }
+
+  /* The include path or source directory dir is in. */
+  const fs::path *root_of(const fs::path &dir) const {
+    for (const IncludePath &inc : resolver_.include_paths()) {
+      if (dir == inc.path || is_under(dir, inc.path)) {
+        return &inc.path;
+      }
+    }
+    for (const fs::path &source_dir : source_dirs_) {
+      if (dir == source_dir || is_under(dir, source_dir)) {
+        return &source_dir;
+      }
+    }
+    return nullptr;
+  }
+
+  void watch_dir(const fs::path &dir) {
+    int wd = ::inotify_add_watch(fd_, dir.c_str(), MASK);
+    if (wd >= 0) {
+      dirs_[wd] = dir;
+      wds_[dir.string()] = wd;
+    }
+  }
+
+  void unwatch_tree(const fs::path &dir) {
+    std::string exact = dir.string();
+    std::string prefix = (dir / "").string();
+    for (auto it = wds_.lower_bound(exact); it != wds_.end();) {
+      if (it->first == exact ||
+          it->first.compare(0, prefix.size(), prefix) == 0) {
+        ::inotify_rm_watch(fd_, it->second);
+        dirs_.erase(it->second);
+        it = wds_.erase(it);
+      } else if (it->first > prefix) {
+        break;
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  bool is_header(const fs::path &file) const {
+    if (!has_header_extension(file)) {
+      return false;
+    }
+    for (const IncludePath &inc : resolver_.include_paths()) {
+      if (is_under(file, inc.path)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool is_source(const fs::path &file) const {
+    if (!has_source_extension(file)) {
+      return false;
+    }
+    for (const fs::path &dir : source_dirs_) {
+      if (is_under(file, dir)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  static bool is_under(const fs::path &file, const fs::path &dir) {
+    fs::path relative = file.lexically_relative(dir);
+    return !relative.empty() && *relative.begin() != "..";
+  }
+
+  Resolver &resolver_;
+  std::vector<fs::path> source_dirs_;
+  std::function<void(const FileReport &)> on_report_;
+  std::ostream &log_;
+  int fd_{-1};
+  std::unordered_map<int, fs::path> dirs_;
+  std::map<std::string, int> wds_;
+  ReverseIncludeIndex users_;
+};
+
+/* Watches until an error occurs. Returns the exit code. */
+inline int watch(Resolver &resolver, std::vector<fs::path> source_dirs,
+                 std::function<void(const FileReport &)> on_report,
+                 std::ostream &log) {
+  Watcher watcher(resolver, std::move(source_dirs), std::move(on_report), log);
+  return watcher.run();
+}
+
+#else
+
+inline int watch(Resolver &resolver, std::vector<fs::path> source_dirs,
+                 std::function<void(const FileReport &)> on_report,
+                 std::ostream &log) {
+  log << "--watch needs inotify." << std::endl;
+  return 1;
+}
+
+#endif
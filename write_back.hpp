@@ -0,0 +1,528 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <mutex>
+#include <ostream>
+#include <set>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include "report.hpp"
+#include "sfincludes.hpp"
+#include "stats.hpp"
+#include "vfs.hpp"
+
+/* The temporary file a new version of file is written to: next to it, so
+ * that renaming it over file is atomic. */
+inline fs::path write_back_temp_path(const fs::path &file) {
+  fs::path tmp = file;
+  tmp += ".sfincludes-tmp";
+  return tmp;
+}
+
+inline bool is_write_back_temp_path(const fs::path &file) {
+  return file.extension() == ".sfincludes-tmp";
+}
+
+/* Writes contents to tmp, with the permissions of file. */
+inline bool write_temp_file(const fs::path &file, const fs::path &tmp,
+                            std::string_view contents) {
+  std::error_code ec;
+  {
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    out.write(contents.data(), contents.size());
+    out.close();
+    if (!out) {
+      fs::remove(tmp, ec);
+      return false;
+    }
+  }
+  fs::file_status status = fs::status(file, ec);
+  if (!ec) {
+    fs::permissions(tmp, status.permissions(), ec);
+  }
+  return true;
+}
+
+/* Replaces the contents of a file at once: readers see the old or the new
+ * version, never a truncated one. A symlink is written through. */
+inline bool write_file_atomically(const fs::path &path,
+                                  std::string_view contents) {
+  std::error_code ec;
+  fs::path file = fs::is_symlink(path) ? fs::canonical(path, ec) : path;
+  if (ec) {
+    return false;
+  }
+  fs::path tmp = write_back_temp_path(file);
+  if (!write_temp_file(file, tmp, contents)) {
+    return false;
+  }
+  fs::rename(tmp, file, ec);
+  if (ec) {
+    fs::remove(tmp, ec);
+    return false;
+  }
+  return true;
+}
+
+/* The undo journal of a commit is a directory with the original version of
+ * every rewritten file, named by its number, and a "journal" file listing
+ * the changes, one per line:
+ *
+ *   write <number> <file>
+ *   rename <from> <to>
+ *
+ * Fields are separated by tabs; tabs, newlines and backslashes in paths are
+ * escaped with a backslash. Paths are absolute. */
+namespace journal {
+
+constexpr std::string_view MAGIC = "sfincludes undo journal 1";
+
+inline std::string escape(const std::string &s) {
+  std::string out;
+  for (char c : s) {
+    if (c == '\\') {
+      out += "\\\\";
+    } else if (c == '\t') {
+      out += "\\t";
+    } else if (c == '\n') {
+      out += "\\n";
+    } else {
+      out += c;
+    }
+  }
+  return out;
+}
+
+inline std::string unescape(std::string_view s) {
+  std::string out;
+  for (size_t i = 0; i < s.size(); ++i) {
+    if (s[i] == '\\' && i + 1 < s.size()) {
+      char c = s[++i];
+      out += c == 't' ? '\t' : c == 'n' ? '\n' : c;
+    } else {
+      out += s[i];
+    }
+  }
+  return out;
+}
+
+inline std::vector<std::string> split_fields(std::string_view line) {
+  std::vector<std::string> fields;
+  size_t start = 0, tab;
+  while ((tab = line.find('\t', start)) != std::string_view::npos) {
+    fields.push_back(unescape(line.substr(start, tab - start)));
+    start = tab + 1;
+  }
+  fields.push_back(unescape(line.substr(start)));
+  return fields;
+}
+
+/* Whether dir is missing, an empty directory, or a journal: not something
+ * else, such as a mistyped --undo-journal. */
+inline bool is_replaceable(const fs::path &dir) {
+  std::error_code ec;
+  if (!fs::exists(dir, ec) || (fs::is_directory(dir, ec) &&
+                               fs::is_empty(dir, ec) && !ec)) {
+    return true;
+  }
+  std::ifstream in(dir / "journal", std::ios::binary);
+  std::string line;
+  return in && std::getline(in, line) && line == MAGIC;
+}
+
+/* Removes the journal in dir, if there is one: the backups and the journal
+ * file it lists, and then dir, if nothing else is left in it. Returns false,
+ * removing nothing, unless is_replaceable(dir). */
+inline bool remove_journal(const fs::path &dir) {
+  if (!is_replaceable(dir)) {
+    return false;
+  }
+  std::error_code ec;
+  std::ifstream in(dir / "journal", std::ios::binary);
+  std::string line;
+  std::getline(in, line);
+  while (std::getline(in, line)) {
+    std::vector<std::string> fields = split_fields(line);
+    /* Backups are named by their number, never a path. */
+    if (fields.size() == 3 && fields[0] == "write" && !fields[1].empty() &&
+        std::all_of(fields[1].begin(), fields[1].end(),
+                    [](char c) { return c >= '0' && c <= '9'; })) {
+      fs::remove(dir / fields[1], ec);
+    }
+  }
+  in.close();
+  fs::remove(dir / "journal.tmp", ec);
+  fs::remove(dir / "journal", ec);
+  fs::remove(dir, ec); // Fails if something else is still in it.
+  return true;
+}
+
+/* Calls f(i) for every i < n, on up to jobs threads. */
+template <typename F> void parallel_for(size_t n, int jobs, F f) {
+  int num_threads = std::max<size_t>(1, std::min<size_t>(jobs, n));
+  std::atomic<size_t> next{0};
+  auto worker = [&]() {
+    size_t i;
+    while ((i = next++) < n) {
+      f(i);
+    }
+  };
+  std::vector<std::thread> threads;
+  for (int t = 1; t < num_threads; ++t) {
+    threads.emplace_back([&]() {
+      worker();
+      flush_thread_stats();
+    });
+  }
+  worker();
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+}
+
+} // namespace journal
+
+/* The changes of a run, applied together by commit(): the files to rewrite
+ * and the headers to rename. Renames are staged before any file is
+ * processed, and exists() sees them as done already. Files may be staged
+ * from several threads at once. */
+class WriteBack {
+public:
+  void rename(const fs::path &from, const fs::path &to) {
+    renames_.push_back({from, to});
+    renamed_from_.insert(key(from));
+    renamed_to_.insert(key(to));
+  }
+
+  /* A symlinked file is written through: the link stays a link. */
+  void write(const fs::path &file, std::string contents) {
+    std::error_code ec;
+    fs::path target = fs::is_symlink(file) ? fs::canonical(file, ec) : file;
+    std::lock_guard<std::mutex> lock(mutex_);
+    writes_.push_back({ec ? file : target, std::move(contents)});
+  }
+
+  /* Whether path will exist once the staged renames are done, with vfs
+   * telling whether it exists now. */
+  bool exists(const fs::path &path, const Vfs &vfs = disk_vfs()) const {
+    if (renames_.empty()) {
+      return vfs.exists(path);
+    }
+    std::string k = key(path);
+    if (renamed_to_.count(k)) {
+      return true;
+    }
+    return !renamed_from_.count(k) && vfs.exists(path);
+  }
+
+  size_t num_writes() const { return writes_.size(); }
+  size_t num_renames() const { return renames_.size(); }
+  bool empty() const { return writes_.empty() && renames_.empty(); }
+
+  /* Applies all staged changes, replacing the undo journal in journal_dir.
+   * The new files are written next to the originals first, on jobs threads;
+   * only when all of them are, the journal is written and the new files are
+   * renamed over the originals, followed by the header renames. A failure
+   * before that leaves the tree untouched; one after it can be undone with
+   * undo_write_back(). The new journal is prepared next to journal_dir, and
+   * only replaces the previous one once it is complete, so that the previous
+   * run can still be undone when this one fails. A rename onto an existing
+   * file is refused, as undoing it could not bring that file back, and so is
+   * a journal_dir that is not a journal. */
+  bool commit(const fs::path &journal_dir, int jobs, std::ostream &log) {
+    PhaseTimer phase(Phase::WriteBack);
+    std::sort(writes_.begin(), writes_.end(),
+              [](const FileWrite &a, const FileWrite &b) {
+                return a.file < b.file;
+              });
+    // The same file through several symlinks: the first version wins.
+    writes_.erase(std::unique(writes_.begin(), writes_.end(),
+                              [](const FileWrite &a, const FileWrite &b) {
+                                return a.file == b.file;
+                              }),
+                  writes_.end());
+    std::vector<std::string> errors;
+    std::set<std::string> targets;
+    for (const Rename &rename : renames_) {
+      std::error_code exists_ec;
+      if (fs::exists(fs::symlink_status(rename.to, exists_ec)) ||
+          !targets.insert(key(rename.to)).second) {
+        errors.push_back("Cannot rename " + rename.from.string() + ": " +
+                         rename.to.string() + " exists already");
+      }
+    }
+    if (!errors.empty()) {
+      print_errors(log, errors);
+      log << RED << "Nothing was changed." << CLEAR << std::endl;
+      return false;
+    }
+    fs::path sibling = journal_dir.lexically_normal();
+    if (!sibling.has_filename()) {
+      sibling = sibling.parent_path(); // "journal/" is next to "journal.new"
+    }
+    fs::path staging = sibling;
+    staging += ".new";
+    fs::path previous = sibling;
+    previous += ".old";
+    for (const fs::path &dir : {journal_dir, staging, previous}) {
+      if (!journal::is_replaceable(dir)) {
+        log << RED << "ERROR: " << dir
+            << " is not an undo journal, not replacing it. Nothing was "
+               "changed."
+            << CLEAR << std::endl;
+        return false;
+      }
+    }
+    journal::remove_journal(staging);
+    journal::remove_journal(previous);
+    std::error_code ec;
+    fs::create_directories(staging, ec);
+    if (ec) {
+      log << RED << "ERROR: Cannot create the undo journal " << staging
+          << ": " << ec.message() << CLEAR << std::endl;
+      return false;
+    }
+
+    /* The originals are kept as hard links in the journal: no copy is made,
+     * unless the journal is on another file system. */
+    errors.assign(writes_.size(), std::string());
+    journal::parallel_for(writes_.size(), jobs, [&](size_t i) {
+      const fs::path &file = writes_[i].file;
+      fs::path backup = staging / std::to_string(i);
+      std::error_code ec;
+      fs::create_hard_link(file, backup, ec);
+      if (ec) {
+        fs::copy_file(file, backup, ec);
+      }
+      if (ec) {
+        errors[i] = "Cannot back up " + file.string() + ": " + ec.message();
+      } else if (!write_temp_file(file, write_back_temp_path(file),
+                                  writes_[i].contents)) {
+        errors[i] = "Cannot write " + write_back_temp_path(file).string();
+      }
+    });
+    bool prepared = std::all_of(errors.begin(), errors.end(),
+                                [](const std::string &e) { return e.empty(); });
+    if (prepared && !write_journal(staging)) {
+      errors.push_back("Cannot write the undo journal in " + staging.string());
+      prepared = false;
+    }
+    /* The previous journal is set aside until the new one is in place. */
+    bool had_previous = fs::exists(journal_dir, ec);
+    if (prepared && had_previous) {
+      fs::rename(journal_dir, previous, ec);
+      if (ec) {
+        errors.push_back("Cannot replace the undo journal " +
+                         journal_dir.string() + ": " + ec.message());
+        prepared = false;
+      }
+    }
+    if (prepared) {
+      fs::rename(staging, journal_dir, ec);
+      if (ec) {
+        errors.push_back("Cannot replace the undo journal " +
+                         journal_dir.string() + ": " + ec.message());
+        prepared = false;
+        if (had_previous) {
+          fs::rename(previous, journal_dir, ec);
+        }
+      }
+    }
+    if (!prepared) {
+      for (size_t i = 0; i < writes_.size(); ++i) {
+        fs::remove(write_back_temp_path(writes_[i].file), ec);
+        fs::remove(staging / std::to_string(i), ec);
+      }
+      fs::remove(staging / "journal.tmp", ec);
+      fs::remove(staging / "journal", ec);
+      fs::remove(staging, ec);
+      print_errors(log, errors);
+      log << RED << "Nothing was changed." << CLEAR << std::endl;
+      return false;
+    }
+    journal::remove_journal(previous);
+
+    errors.assign(writes_.size(), std::string());
+    journal::parallel_for(writes_.size(), jobs, [&](size_t i) {
+      const fs::path &file = writes_[i].file;
+      std::error_code ec;
+      fs::rename(write_back_temp_path(file), file, ec);
+      if (ec) {
+        errors[i] = "Cannot replace " + file.string() + ": " + ec.message();
+      }
+    });
+    for (const Rename &rename : renames_) {
+      fs::rename(rename.from, rename.to, ec);
+      if (ec) {
+        errors.push_back("Cannot rename " + rename.from.string() + ": " +
+                         ec.message());
+      }
+    }
+    if (!std::all_of(errors.begin(), errors.end(),
+                     [](const std::string &e) { return e.empty(); })) {
+      print_errors(log, errors);
+      log << RED << "Use --undo to restore the previous state." << CLEAR
+          << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+private:
+  struct FileWrite {
+    fs::path file;
+    std::string contents;
+  };
+
+  struct Rename {
+    fs::path from;
+    fs::path to;
+  };
+
+  static std::string key(const fs::path &path) {
+    return fs::absolute(path).lexically_normal().string();
+  }
+
+  bool write_journal(const fs::path &journal_dir) const {
+    fs::path tmp = journal_dir / "journal.tmp";
+    {
+      std::ofstream out(tmp, std::ios::binary);
+      out << journal::MAGIC << '\n';
+      for (size_t i = 0; i < writes_.size(); ++i) {
+        out << "write\t" << i << '\t'
+            << journal::escape(fs::absolute(writes_[i].file).string())
+            << '\n';
+      }
+      for (const Rename &rename : renames_) {
+        out << "rename\t" << journal::escape(fs::absolute(rename.from).string())
+            << '\t' << journal::escape(fs::absolute(rename.to).string())
+            << '\n';
+      }
+      out.close();
+      if (!out) {
+        return false;
+      }
+    }
+    std::error_code ec;
+    fs::rename(tmp, journal_dir / "journal", ec);
+    return !ec;
+  }
+
+  static void print_errors(std::ostream &log,
+                           const std::vector<std::string> &errors) {
+    for (const std::string &error : errors) {
+      if (!error.empty()) {
+        log << RED << "ERROR: " << error << CLEAR << std::endl;
+      }
+    }
+  }
+
+  std::mutex mutex_;
+  std::vector<FileWrite> writes_;
+  std::vector<Rename> renames_;
+  std::set<std::string> renamed_from_;
+  std::set<std::string> renamed_to_;
+};
+
+/* Restores the state before the commit recorded in journal_dir, on jobs
+ * threads: the header renames are reverted, and the original files moved
+ * back. The journal is removed once all of it is undone (see
+ * journal::remove_journal()). */
+inline bool undo_write_back(const fs::path &journal_dir, int jobs,
+                            std::ostream &log) {
+  PhaseTimer phase(Phase::WriteBack);
+  std::ifstream in(journal_dir / "journal", std::ios::binary);
+  std::string line;
+  if (!in || !std::getline(in, line) || line != journal::MAGIC) {
+    log << RED << "ERROR: No undo journal in " << journal_dir << CLEAR
+        << std::endl;
+    return false;
+  }
+  std::vector<std::pair<std::string, fs::path>> writes; // backup, file
+  std::vector<std::pair<fs::path, fs::path>> renames;
+  while (std::getline(in, line)) {
+    std::vector<std::string> fields = journal::split_fields(line);
+    if (fields.size() == 3 && fields[0] == "write") {
+      writes.push_back({fields[1], fields[2]});
+    } else if (fields.size() == 3 && fields[0] == "rename") {
+      renames.push_back({fields[1], fields[2]});
+    } else {
+      log << RED << "ERROR: Malformed undo journal line: " << line << CLEAR
+          << std::endl;
+      return false;
+    }
+  }
+  in.close();
+
+  std::vector<std::string> errors;
+  std::error_code ec;
+  size_t reverted = 0;
+  /* A rename whose source is back and whose target is gone was reverted by
+   * an earlier attempt. Any other state is left to the user to sort out,
+   * keeping the journal for another attempt. */
+  for (auto it = renames.rbegin(); it != renames.rend(); ++it) {
+    const auto &[from, to] = *it;
+    bool to_exists = fs::exists(fs::symlink_status(to, ec));
+    bool from_exists = fs::exists(fs::symlink_status(from, ec));
+    if (!to_exists && from_exists) {
+      continue;
+    } else if (!to_exists) {
+      errors.push_back("Cannot rename " + to.string() + " back to " +
+                       from.string() + ": it is missing");
+      continue;
+    } else if (from_exists) {
+      errors.push_back("Cannot rename " + to.string() + " back to " +
+                       from.string() + ": that exists again");
+      continue;
+    }
+    fs::rename(to, from, ec);
+    if (ec) {
+      errors.push_back("Cannot rename " + to.string() + ": " + ec.message());
+      continue;
+    }
+    reverted++;
+  }
+  /* A file whose backup is gone was restored by an earlier attempt. */
+  std::vector<std::string> write_errors(writes.size());
+  std::atomic<size_t> restored{0};
+  journal::parallel_for(writes.size(), jobs, [&](size_t i) {
+    fs::path backup = journal_dir / writes[i].first;
+    const fs::path &file = writes[i].second;
+    std::error_code ec;
+    fs::remove(write_back_temp_path(file), ec);
+    if (!fs::exists(backup)) {
+      return;
+    }
+    fs::rename(backup, file, ec);
+    if (ec) {
+      fs::copy_file(backup, file, fs::copy_options::overwrite_existing, ec);
+    }
+    if (ec) {
+      write_errors[i] = "Cannot restore " + file.string() + ": " +
+                        ec.message();
+    } else {
+      restored++;
+    }
+  });
+  for (std::string &error : write_errors) {
+    if (!error.empty()) {
+      errors.push_back(std::move(error));
+    }
+  }
+  log << "Undo: " << restored << " files restored, " << reverted
+      << " renames reverted." << std::endl;
+  if (!errors.empty()) {
+    for (const std::string &error : errors) {
+      log << RED << "ERROR: " << error << CLEAR << std::endl;
+    }
+    return false;
+  }
+  journal::remove_journal(journal_dir);
+  return true;
+}